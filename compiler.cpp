@@ -2,68 +2,20 @@
 #include <unordered_set>
 #include <iterator>
 #include <algorithm>
+#include <cstring>
+#include <limits>
 #include "llvm/Pass.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/OptimizationRemarkEmitter.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Passes/PassBuilder.h"
+#include "llvm/ProfileData/InstrProf.h"
+#include "llvm/ProfileData/ProfileCommon.h"
 // #include "llvm/Transforms/Scalar/TailRecursionElimination.h"
 
 #include <type_traits>
 
-template <typename T>
-struct Discriminator : public FormVisitor {
-  T* ref {nullptr};
-
-  static T* as(Form& f) {
-    Discriminator<T> d;
-    f.accept(d);
-    return d.ref;
-  }
-
-  void operator()(NumberForm& f) override {
-    if constexpr (std::is_same<T, NumberForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(SymbolForm& f) override {
-    if constexpr (std::is_same<T, SymbolForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(IfForm& f) override {
-    if constexpr (std::is_same<T, IfForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(LetForm& f) override {
-    if constexpr (std::is_same<T, LetForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(LetrecForm& f) override {
-    if constexpr (std::is_same<T, LetrecForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(QuoteForm& f) override {
-    if constexpr (std::is_same<T, QuoteForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(ApplicationForm& f) override {
-    if constexpr (std::is_same<T, ApplicationForm>()) {
-      ref = &f;
-    }
-  }
-  void operator()(LambdaForm& f) override {
-    if constexpr (std::is_same<T, LambdaForm>()) {
-      ref = &f;
-    }
-  }
-};
-
 auto Compiler::lookup(Symbol s) -> const VariableEntry* {
   auto res1 = locals.get(s);
   if (res1) {
@@ -73,16 +25,48 @@ auto Compiler::lookup(Symbol s) -> const VariableEntry* {
   return res2 == globals.end() ? nullptr : &res2->second;
 }
 
-Compiler::Compiler(bool optimize)
-  : optimize{optimize}
+bool Compiler::is_primitive(Symbol s) {
+  auto it = globals.find(s);
+  return it != globals.end() && std::holds_alternative<Function*>(it->second);
+}
+
+Compiler::Compiler(bool optimize, bool debug_info)
+  : optimize{optimize}, debug_info{debug_info}
 {
+  auto i64_type = Type::getInt64Ty(context);
+  object_type = StructType::create({i64_type, i64_type}, "Object");
+  likely_weights = MDBuilder{context}.createBranchWeights(2000, 1);
+  unlikely_weights = MDBuilder{context}.createBranchWeights(1, 2000);
+}
+
+void Compiler::begin_module(const std::string& entry_name) {
+  // start from a clean slate, a previous module may have been
+  // abandoned halfway through because of an error
+  module_ptr = std::make_unique<Module>(entry_name, context);
+  module = module_ptr.get();
+  globals.clear();
+  locals = {};
+  enclosing_binder = nullptr;
+  di_scopes.clear();
+  builder.SetCurrentDebugLocation({});
+  call_closure_cache.clear();
+  comparisons.clear();
+  arithmetic.clear();
+  type_predicates.clear();
+  pending_definitions.clear();
+  instrumented_lambdas.clear();
+  promotions.clear();
+  static_closures.clear();
+  free_var_time = {};
+  inject_time = {};
+
   auto&& declare_function =
     [&](auto&& type,
 	const char* llvm_name,
 	const char* var_name) {
       Function* f =
 	Function::Create(type, Function::ExternalLinkage,
-			 llvm_name, module);
+			 llvm_name, *module);
       if (var_name)
 	globals[memory.symbol(var_name)] = f;
       // variables.set(var_name, f);
@@ -103,142 +87,216 @@ Compiler::Compiler(bool optimize)
   auto char_ptr_type =
     Type::getInt8PtrTy(context);
 
-  object_type = StructType::create({i64_type, i64_type}, "Object");
   auto object_ptr_type = PointerType::getUnqual(object_type);
     
   auto binary_op =
     FunctionType::get(object_type, {object_type, object_type}, false);    
   auto unary_op =
     FunctionType::get(object_type, {object_type}, false);
+  auto ternary_op =
+    FunctionType::get(object_type, {object_type, object_type, object_type}, false);
 
-  main =
-    declare_function(FunctionType::get(void_type, {}, false),
-		     "main",
+  entry =
+    declare_function(FunctionType::get(object_type, {}, false),
+		     entry_name.c_str(),
 		     nullptr);
   make_symbol_function = 
     declare_function(FunctionType::get(object_type,{char_ptr_type}, false),
-		     "make_symbol",nullptr);
+		     "_make_symbol",nullptr);
   make_number_function =
     declare_function(FunctionType::get(object_type,{double_type}, false),
-		     "make_number", nullptr);
+		     "_make_number", nullptr);
   is_nil_function =
     declare_function(FunctionType::get(bool_type, {object_type}, false),
-		     "is_nil", nullptr);
-  get_code_function =
-    declare_function(FunctionType::get(char_ptr_type, {object_type, i32_type}, false),
-		     "get_code", nullptr);
-  get_fvs_function =
-    declare_function(FunctionType::get(object_ptr_type, {object_type}, false),
-		     "get_fvs", nullptr);
-  get_fv_function =
-    declare_function(FunctionType::get(object_type, {object_ptr_type, i32_type}, false),
-		     "get_fv", nullptr);
+		     "_is_nil", nullptr);
+  call_error_function =
+    declare_function(FunctionType::get(void_type, {object_type, i32_type}, false),
+		     "_call_error", nullptr);
+  call_error_function->setDoesNotReturn();
+  call_error_function->addFnAttr(Attribute::Cold);
+  profile_call_function =
+    declare_function(FunctionType::get(void_type, {char_ptr_type, object_type}, false),
+		     "_profile_call", nullptr);
   create_closure_function =
     declare_function(FunctionType::get(object_type,
 				       {char_ptr_type,
 					object_ptr_type, i32_type,
 					i32_type},
 				       false),
-		     "create_closure", nullptr);
-
-  declare_function(binary_op, "add", "add");
-  declare_function(binary_op, "sub", "sub");
-  declare_function(binary_op, "mult", "mult");
-  declare_function(binary_op, "_div", "div");
-  cons_function = declare_function(binary_op, "cons", "cons");
-  declare_function(unary_op, "car", "car");
-  declare_function(unary_op, "cdr", "cdr");
-  declare_function(unary_op, "print", "print");    
+		     "_create_closure", nullptr);
+
+  arithmetic[declare_function(binary_op, "_add", "add")] =
+    Intrinsic::sadd_with_overflow;
+  arithmetic[declare_function(binary_op, "_sub", "sub")] =
+    Intrinsic::ssub_with_overflow;
+  arithmetic[declare_function(binary_op, "_mult", "mult")] =
+    Intrinsic::smul_with_overflow;
+  declare_function(binary_op, "__div", "div");
+  cons_function = declare_function(binary_op, "_cons", "cons");
+  make_list_function =
+    declare_function(FunctionType::get(object_type,
+				       {object_ptr_type, i64_type, object_type},
+				       false),
+		     "_make_list", nullptr);
+  declare_function(unary_op, "_car", "car");
+  declare_function(unary_op, "_cdr", "cdr");
+  declare_function(unary_op, "_print", "print");    
+  declare_function(binary_op, "_make_vector", "make-vector");
+  declare_function(unary_op, "_list_to_vector", "list->vector");
+  declare_function(unary_op, "_vector_length", "vector-length");
+  declare_function(binary_op, "_vector_ref", "vector-ref");
+  declare_function(binary_op, "_vector_map", "vector-map");
+  declare_function(unary_op, "_vector_sum", "vector-sum");
+  declare_function(binary_op, "_dot", "dot");
+  declare_function(FunctionType::get(object_type, {}, false),
+		   "_make_table", "make-table");
+  declare_function(binary_op, "_table_get", "table-get");
+  declare_function(ternary_op, "_table_put", "table-put");
+  declare_function(unary_op, "_table_count", "table-count");
+  declare_function(unary_op, "_spawn", "spawn");
+  declare_function(unary_op, "_join", "join");
+  declare_function(binary_op, "_pmap", "pmap");
+
+  is_equal_function =
+    declare_function(FunctionType::get(bool_type, {object_type, object_type}, false),
+		     "_is_equal", nullptr);
+  equal_function = declare_function(binary_op, "_equal", "equal");
+  null_p_function = declare_function(unary_op, "_null_p", "null?");
+  comparisons[declare_function(binary_op, "_lt", "<")] = CmpInst::FCMP_OLT;
+  comparisons[declare_function(binary_op, "_gt", ">")] = CmpInst::FCMP_OGT;
+  comparisons[declare_function(binary_op, "_le", "<=")] = CmpInst::FCMP_OLE;
+  comparisons[declare_function(binary_op, "_ge", ">=")] = CmpInst::FCMP_OGE;
+  comparisons[declare_function(binary_op, "_num_eq", "=")] = CmpInst::FCMP_OEQ;
+  type_predicates[declare_function(unary_op, "_number_p", "number?")] =
+    Object::tag_number;
+  type_predicates[declare_function(unary_op, "_symbol_p", "symbol?")] =
+    Object::tag_symbol;
+  type_predicates[declare_function(unary_op, "_cons_p", "cons?")] =
+    Object::tag_cons;
+  type_predicates[declare_function(unary_op, "_closure_p", "closure?")] =
+    Object::tag_closure;
+  type_predicates[declare_function(unary_op, "_vector_p", "vector?")] =
+    Object::tag_vector;
+  type_predicates[declare_function(unary_op, "_table_p", "table?")] =
+    Object::tag_table;
+  type_predicates[declare_function(unary_op, "_string_p", "string?")] =
+    Object::tag_string;
+  declare_function(unary_op, "_string_length", "string-length");
+  declare_function(binary_op, "_string_append", "string-append");
+  declare_function(ternary_op, "_substring", "substring");
+  declare_function(unary_op, "_string_to_symbol", "string->symbol");
+  declare_function(unary_op, "_symbol_to_string", "symbol->string");
+  declare_function(unary_op, "_open_input_file", "open-input-file");
+  declare_function(FunctionType::get(object_type, {}, false),
+		   "_standard_input", "standard-input");
+  declare_function(unary_op, "_read_line", "read-line");
+  declare_function(unary_op, "_read_datum", "read-datum");
+  declare_function(unary_op, "_read_lines", "read-lines");
+  declare_function(unary_op, "_read_data", "read-data");
+  declare_function(unary_op, "_close_input", "close-input");
+  type_predicates[declare_function(unary_op, "_port_p", "port?")] =
+    Object::tag_port;
     
-  auto block = BasicBlock::Create(context, "entry", main);
+  if (debug_info) {
+    module->addModuleFlag(Module::Warning, "Debug Info Version",
+			  DEBUG_METADATA_VERSION);
+    module->addModuleFlag(Module::Warning, "Dwarf Version", 4);
+    di_builder = std::make_unique<DIBuilder>(*module);
+    di_file = di_builder->createFile("stdin", ".");
+    di_builder->createCompileUnit(dwarf::DW_LANG_C, di_file, "kale",
+				  optimize, "", 0);
+    di_function_type =
+      di_builder->createSubroutineType(di_builder->getOrCreateTypeArray({}));
+  }
+
+  // definitions made by earlier modules live in the JIT, refer to
+  // them by name
+  for (auto&& s : definitions) {
+    globals[s] = new GlobalVariable{*module, object_type, false,
+				    GlobalValue::ExternalLinkage, nullptr,
+				    definition_name(s)};
+  }
+
+  auto block = BasicBlock::Create(context, "entry", entry);
   builder.SetInsertPoint(block);
-  // manager.add(createTailCallEliminationPass());
-  // manager.doInitialization();
+  enter_function(entry, {1, 0});
+}
+
+std::string Compiler::definition_name(Symbol s) {
+  return "global." + std::string{s->name()};
+}
+
+void Compiler::define(Symbol s, Form& f) {
+  // redefining just stores into the existing global
+  auto gv = [&]() -> GlobalVariable* {
+    if (auto it = globals.find(s);
+	it != globals.end() && std::holds_alternative<GlobalVariable*>(it->second)) {
+      return std::get<GlobalVariable*>(it->second);
+    }
+    pending_definitions.push_back(s);
+    return new GlobalVariable{*module, object_type, false,
+			      GlobalValue::ExternalLinkage,
+			      Constant::getNullValue(object_type),
+			      definition_name(s)};
+  }();
+  // bound before compiling the definition so it can refer to itself
+  globals[s] = gv;
+  auto saved_binder = enclosing_binder;
+  enclosing_binder = s;
+  res = compile(f);
+  enclosing_binder = saved_binder;
+  builder.CreateStore(res, gv);
+}
+
+
+
+std::string Compiler::lambda_name(SourcePosition position) {
+  std::string name {enclosing_binder ? enclosing_binder->name() : "lambda"};
+  if (position.line > 0) {
+    name += "@" + std::to_string(position.line)
+      + ":" + std::to_string(position.column);
+  }
+  return name;
+}
+
+void Compiler::enter_function(Function* fn, SourcePosition position) {
+  if (!debug_info) return;
+  auto sp = di_builder->createFunction(di_file, fn->getName(), fn->getName(),
+				       di_file, position.line,
+				       di_function_type, position.line,
+				       DINode::FlagPrototyped,
+				       DISubprogram::SPFlagDefinition);
+  fn->setSubprogram(sp);
+  di_scopes.emplace_back(sp, builder.getCurrentDebugLocation());
+  builder.SetCurrentDebugLocation(DILocation::get(context, position.line, 0, sp));
+}
+
+void Compiler::leave_function() {
+  if (!debug_info) return;
+  builder.SetCurrentDebugLocation(di_scopes.back().second);
+  di_scopes.pop_back();
+}
+
+void Compiler::set_location(SourcePosition position) {
+  if (!debug_info || position.line == 0) return;
+  builder.SetCurrentDebugLocation(DILocation::get(context,
+						  position.line,
+						  position.column,
+						  di_scopes.back().first));
 }
 
 void Compiler::operator()(LetForm& f) {
   locals.push_scope();
+  auto saved_binder = enclosing_binder;
   for (auto&& binding : f.bindings) {
+    enclosing_binder = binding.binder;
     locals.set(binding.binder, compile(*binding.definition));
   }
+  enclosing_binder = saved_binder;
   res = compile(*f.body);
   locals.pop_scope();
 }
 
-template <typename T>
-void remove(const T& t, std::unordered_set<T>& s) {
-  auto it = s.find(t);
-  if (it != s.end())
-      s.erase(it);
-}
-
-template <typename G>
-struct FreeVarCollector : public FormVisitor {
-  G global_lookup;
-  std::unordered_set<Symbol> res;
-  FreeVarCollector(G global_lookup)
-    : global_lookup{global_lookup}
-  {}
-
-  void collect(Form& f) {
-    f.accept(*this);
-  }
-  void operator()(NumberForm& f) override {
-    // no free variables
-  }
-  void operator()(SymbolForm& f) override {
-    if (!global_lookup(f.symbol))
-      res.insert(f.symbol);
-  }
-  void operator()(IfForm& f) override {
-    collect(*f.cond_form);
-    collect(*f.then_form);
-    collect(*f.else_form);
-  }
-  void operator()(LetForm& f) override {
-    // the semantics of let allow one to refer
-    // to variables in previous bindings, thus,
-    // (let ((binder definition) . rest) body)
-    // is essentially equivalent to
-    // ((lambda (binder) (let rest body)) definition)
-    collect(*f.body);
-    for (auto it = f.bindings.rbegin();
-	 it != f.bindings.rend();
-	 ++it) {
-      auto& binding = *it;
-      remove(binding.binder, res);
-      collect(*binding.definition);
-    }
-  }
-  void operator()(LetrecForm& f) override {
-    collect(*f.body);
-    for (auto&& binding : f.bindings) {
-      collect(*binding.definition);
-      for (auto&& parameter : binding.parameters) {
-	remove(parameter, res);
-      }
-    }
-    for (auto&& binding : f.bindings) {
-      remove(binding.binder, res);
-    }
-  }
-  void operator()(QuoteForm& f) override {
-    //no free variables
-  }
-  void operator()(ApplicationForm& f) override {
-    collect(*f.function_form);
-    for (auto&& arg : f.arg_forms) {
-      collect(*arg);
-    }
-  }
-  void operator()(LambdaForm& f) override {
-    collect(*f.body);
-    for (auto&& parameter : f.parameters) {
-      remove(parameter, res);
-    }
-  }
-};
-
 template <typename T>
 struct ApplicationInjector : public FormVisitor {
   Symbol fn_symbol;
@@ -314,8 +372,99 @@ struct ApplicationInjector : public FormVisitor {
   }
 };
 
+// Renames the references to a letrec function that don't call it but
+// use it as a value, down to where another binding shadows it.
+struct ValueReferenceRenamer : public FormVisitor {
+  Symbol from;
+  Symbol to;
+  bool renamed {false};
+
+  ValueReferenceRenamer(Symbol from, Symbol to)
+    : from{from}, to{to}
+  {}
+
+  void rename(Form& f) {
+    f.accept(*this);
+  }
+  void rename(FunctionBinding& binding) {
+    auto&& parameters = binding.parameters;
+    if (std::find(parameters.begin(), parameters.end(), from) == parameters.end()) {
+      rename(*binding.definition);
+    }
+  }
+
+  void operator()(NumberForm& f) override {}
+  void operator()(SymbolForm& f) override {
+    if (f.symbol == from) {
+      f.symbol = to;
+      renamed = true;
+    }
+  }
+  void operator()(IfForm& f) override {
+    rename(*f.cond_form);
+    rename(*f.then_form);
+    rename(*f.else_form);
+  }
+  void operator()(LetForm& f) override {
+    for (auto&& binding : f.bindings) {
+      rename(*binding.definition);
+      if (binding.binder == from) {
+	return;
+      }
+    }
+    rename(*f.body);
+  }
+  void operator()(LetrecForm& f) override {
+    for (auto&& binding : f.bindings) {
+      if (binding.binder == from) {
+	return;
+      }
+    }
+    for (auto&& binding : f.bindings) {
+      rename(binding);
+    }
+    rename(*f.body);
+  }
+  void operator()(QuoteForm& f) override {}
+  void operator()(ApplicationForm& f) override {
+    for (auto&& arg_form : f.arg_forms) {
+      rename(*arg_form);
+    }
+    if (!Discriminator<SymbolForm>::as(*f.function_form)) {
+      rename(*f.function_form);
+    }
+  }
+  void operator()(LambdaForm& f) override {
+    if (std::find(f.parameters.begin(), f.parameters.end(), from)
+	== f.parameters.end()) {
+      rename(*f.body);
+    }
+  }
+};
+
+// whether a function body has (self ...) or (cons x (self ...)) in tail
+// position
+static bool has_tail_self_call(Form& f, Symbol self) {
+  if (auto if_form = Discriminator<IfForm>::as(f)) {
+    return has_tail_self_call(*if_form->then_form, self)
+      || has_tail_self_call(*if_form->else_form, self);
+  }
+  if (auto let_form = Discriminator<LetForm>::as(f)) {
+    return has_tail_self_call(*let_form->body, self);
+  }
+  auto application = Discriminator<ApplicationForm>::as(f);
+  if (!application) return false;
+  auto head = Discriminator<SymbolForm>::as(*application->function_form);
+  if (head && head->symbol == self) return true;
+  if (application->arg_forms.size() != 2) return false;
+  auto cdr = Discriminator<ApplicationForm>::as(*application->arg_forms[1]);
+  auto cdr_head = cdr ? Discriminator<SymbolForm>::as(*cdr->function_form) : nullptr;
+  return head && head->symbol == Constants::cons.as_symbol()
+    && cdr_head && cdr_head->symbol == self;
+}
+
 void Compiler::operator()(LetrecForm& f) {
-  std::unique_ptr<Form> placeholder = std::make_unique<NumberForm>(0);    
+  std::unique_ptr<Form> placeholder = std::make_unique<NumberForm>(Object::fixnum(0));    
   // we want to collect the free vars happening within the
   // bindings. by swapping out he body of the form with something with
   // no free variables we can collect the free variables with one
@@ -323,16 +472,44 @@ void Compiler::operator()(LetrecForm& f) {
   // collectors, collect the free vars of the whole letrec form, then
   // the free vars of the body, then compute set difference)
   std::swap(f.body, placeholder);
+  auto collect_start = std::chrono::steady_clock::now();
   FreeVarCollector collector {
     [&](auto&& s) {
       return globals.find(s) != globals.end();
     }
   };
   collector.collect(f);
+  free_var_time += std::chrono::steady_clock::now() - collect_start;
   std::swap(f.body, placeholder);
   std::vector<Symbol> fvs {collector.res.begin(), collector.res.end()};
+  auto n_free_variables = fvs.size();
+  std::vector<std::size_t> arities;
+  for (auto&& binding : f.bindings) {
+    arities.push_back(binding.parameters.size());
+  }
+
+  // A function with free variables that is used as a value gets one
+  // closure, made when the letrec is entered. The references to it
+  // are renamed to a variable holding the closure (with a name no
+  // source can spell), which is then passed along with the free
+  // variables, so the definitions and the lambdas in them see it too.
+  std::vector<std::pair<std::size_t, Symbol>> shared_closures;
+  if (fvs.size() > 0) {
+    for (std::size_t i = 0; i < f.bindings.size(); ++i) {
+      auto binder = f.bindings[i].binder;
+      auto closure_symbol = memory.symbol(std::string{binder->name()} + " closure");
+      ValueReferenceRenamer renamer{binder, closure_symbol};
+      for (auto&& binding : f.bindings) {
+	renamer.rename(binding);
+      }
+      renamer.rename(*f.body);
+      if (renamer.renamed) {
+	shared_closures.emplace_back(i, closure_symbol);
+	fvs.push_back(closure_symbol);
+      }
+    }
+  }
 
- 
   auto&& injectee_creator = [&](){
     std::vector<std::unique_ptr<Form>> injectees;
     for (auto&& fv : fvs) {
@@ -342,16 +519,21 @@ void Compiler::operator()(LetrecForm& f) {
   };
 
   if (fvs.size() > 0) {
-    // inject the free variables into each binding definition and body
+    auto inject_start = std::chrono::steady_clock::now();
+    // inject the free variables into the calls of each binding, which
+    // can come from any of the definitions and the body
     for (auto&& binding : f.bindings) {
       ApplicationInjector ai{binding.binder, injectee_creator};
-      ai.inject(*binding.definition);
+      for (auto&& caller : f.bindings) {
+	ai.inject(*caller.definition);
+      }
       ai.inject(*f.body);
       // also inject fvs into parameters
       for (auto&& fv : fvs) {
 	binding.parameters.emplace_back(fv);
       }
     }
+    inject_time += std::chrono::steady_clock::now() - inject_start;
   }
   auto body_insert_block = builder.GetInsertBlock();
   locals.push_scope();
@@ -362,13 +544,19 @@ void Compiler::operator()(LetrecForm& f) {
   for (auto&& binding : f.bindings) {
     std::vector<Type*> parameter_types {binding.parameters.size(), object_type};
     auto type = FunctionType::get(object_type, parameter_types, false);
+    // external: LLVM rewrites the return type of an internal function
+    // it sees every call of, and repacking the result after a call
+    // takes it out of tail position
+    std::string name {binding.binder->name()};
+    if (prefix_letrec_names) name = module->getName().str() + "." + name;
     Function* fn = Function::Create(type, Function::ExternalLinkage,
-				    *binding.binder, module);    
+				    name, *module);
     locals.set(binding.binder, fn);
     fns.push_back(fn); 
   }
 
   // Recursively compile each function
+  auto saved_binder = enclosing_binder;
   auto binding_it = f.bindings.begin();
   for (auto&& fn : fns) {
     auto&& binding = *binding_it++;
@@ -379,27 +567,204 @@ void Compiler::operator()(LetrecForm& f) {
     }
     auto block = BasicBlock::Create(context, "entry", fn);
     builder.SetInsertPoint(block);
-    builder.CreateRet(compile(*binding.definition));
+    enter_function(fn, binding.position);
+    count_entry(fn);
+    enclosing_binder = binding.binder;
+    if (has_tail_self_call(*binding.definition, binding.binder)) {
+      compile_loop(fn, binding);
+    } else {
+      builder.CreateRet(compile(*binding.definition));
+    }
+    leave_function();
     locals.pop_scope();
   }
+  enclosing_binder = saved_binder;
 
   builder.SetInsertPoint(body_insert_block);
+  if (!shared_closures.empty()) {
+    // the closures are among each other's free variables, so they are
+    // all created before those are filled in
+    auto nil = object_constant(Constants::nil);
+    std::vector<Value*> closures;
+    for (auto&& [i, closure_symbol] : shared_closures) {
+      auto arr = entry_array(fvs.size());
+      for (std::size_t j = 0; j < fvs.size(); ++j) {
+	Value* fv_val = nil;
+	if (j < n_free_variables) {
+	  SymbolForm fv {fvs[j]};
+	  fv_val = compile(fv);
+	}
+	builder.CreateStore(fv_val, builder.CreateGEP(object_type, arr, {constant_i32(j)}));
+      }
+      auto adapter = closure_adapter(fns[i], arities[i]);
+      auto closure =
+	builder.CreateCall(create_closure_function,
+			   {builder.CreateBitCast(adapter, Type::getInt8PtrTy(context)),
+			    arr, constant_i32(fvs.size()), constant_i32(arities[i])});
+      locals.set(closure_symbol, closure);
+      closures.push_back(closure);
+    }
+    auto header_type = closure_header_type();
+    for (auto&& closure : closures) {
+      auto header =
+	builder.CreateIntToPtr(builder.CreateExtractValue(closure, 1),
+			       PointerType::getUnqual(header_type));
+      auto closure_fvs =
+	builder.CreateBitCast(builder.CreateConstGEP1_32(header_type, header, 1),
+			      PointerType::getUnqual(object_type));
+      for (std::size_t k = 0; k < closures.size(); ++k) {
+	builder.CreateStore(closures[k],
+			    builder.CreateGEP(object_type, closure_fvs,
+					      {constant_i32(n_free_variables + k)}));
+      }
+    }
+  }
   res = compile(*f.body);
   locals.pop_scope();
 }
 
+void Compiler::compile_loop(Function* fn, FunctionBinding& binding) {
+  // the first iteration stores the result into a slot on the stack,
+  // the function returns it once an iteration stores something other
+  // than a cons cell of the loop
+  auto result = builder.CreateAlloca(object_type, nullptr, "result");
+  auto entry_block = builder.GetInsertBlock();
+  TailLoop loop {fn,
+		 BasicBlock::Create(context, "loop", fn),
+		 nullptr,
+		 {},
+		 BasicBlock::Create(context, "exit", fn)};
+  builder.CreateBr(loop.loop_block);
+
+  builder.SetInsertPoint(loop.loop_block);
+  loop.destination =
+    builder.CreatePHI(PointerType::getUnqual(object_type), 2, "destination");
+  loop.destination->addIncoming(result, entry_block);
+  auto it = binding.parameters.begin();
+  for (auto&& arg_value : fn->args()) {
+    auto phi = builder.CreatePHI(object_type, 2, (*it)->name());
+    phi->addIncoming(&arg_value, entry_block);
+    loop.parameters.push_back(phi);
+    locals.set(*it++, phi);
+  }
+
+  auto saved_loop = tail_loop;
+  tail_loop = &loop;
+  compile_tail(*binding.definition);
+  tail_loop = saved_loop;
+
+  builder.SetInsertPoint(loop.exit_block);
+  builder.CreateRet(builder.CreateLoad(object_type, result));
+}
+
+Function* Compiler::direct_callee(ApplicationForm& f) {
+  auto symbol_form = Discriminator<SymbolForm>::as(*f.function_form);
+  auto it = symbol_form ? lookup(symbol_form->symbol) : nullptr;
+  if (!it || !std::holds_alternative<Function*>(*it)) {
+    return nullptr;
+  }
+  return std::get<Function*>(*it);
+}
+
+// Compiles a form in tail position of the tail_loop's function: the
+// value goes to the loop's destination instead of being returned.
+void Compiler::compile_tail(Form& f) {
+  auto saved_location = builder.getCurrentDebugLocation();
+  set_location(f.position);
+  auto application = Discriminator<ApplicationForm>::as(f);
+  auto callee = application ? direct_callee(*application) : nullptr;
+  auto cdr_application =
+    callee == cons_function && application->arg_forms.size() == 2
+    ? Discriminator<ApplicationForm>::as(*application->arg_forms[1])
+    : nullptr;
+
+  if (auto if_form = Discriminator<IfForm>::as(f)) {
+    auto condition_code = compile_condition(*if_form->cond_form);
+    auto curr_fn = builder.GetInsertBlock()->getParent();
+    auto then_block = BasicBlock::Create(context, "then-block", curr_fn);
+    auto else_block = BasicBlock::Create(context, "else-block", curr_fn);
+    branch(condition_code, then_block, else_block, if_form->position);
+    builder.SetInsertPoint(then_block);
+    compile_tail(*if_form->then_form);
+    builder.SetInsertPoint(else_block);
+    compile_tail(*if_form->else_form);
+  } else if (auto let_form = Discriminator<LetForm>::as(f)) {
+    locals.push_scope();
+    auto saved_binder = enclosing_binder;
+    for (auto&& binding : let_form->bindings) {
+      enclosing_binder = binding.binder;
+      locals.set(binding.binder, compile(*binding.definition));
+    }
+    enclosing_binder = saved_binder;
+    compile_tail(*let_form->body);
+    locals.pop_scope();
+  } else if (cdr_application
+	     && direct_callee(*cdr_application) == tail_loop->function) {
+    // allocate the cell with a placeholder cdr, the next iteration
+    // stores the rest of the list there
+    auto car = compile(*application->arg_forms[0]);
+    auto cell = builder.CreateCall(cons_function,
+				   {car, UndefValue::get(object_type)});
+    builder.CreateStore(cell, tail_loop->destination);
+    auto cell_type = StructType::get(object_type, object_type);
+    auto cell_ptr =
+      builder.CreateIntToPtr(builder.CreateExtractValue(cell, 1),
+			     PointerType::getUnqual(cell_type));
+    std::vector<Value*> arguments;
+    for (auto&& arg_form : cdr_application->arg_forms) {
+      arguments.push_back(compile(*arg_form));
+    }
+    jump_to_loop(builder.CreateStructGEP(cell_type, cell_ptr, 1, "cdr"),
+		 std::move(arguments));
+  } else if (callee && callee == tail_loop->function) {
+    std::vector<Value*> arguments;
+    for (auto&& arg_form : application->arg_forms) {
+      arguments.push_back(compile(*arg_form));
+    }
+    jump_to_loop(tail_loop->destination, std::move(arguments));
+  } else {
+    builder.CreateStore(compile(f), tail_loop->destination);
+    builder.CreateBr(tail_loop->exit_block);
+  }
+  builder.SetCurrentDebugLocation(saved_location);
+}
+
+void Compiler::jump_to_loop(Value* destination, std::vector<Value*> arguments) {
+  if (arguments.size() != tail_loop->parameters.size()) {
+    throw std::runtime_error("invalid number of args");
+  }
+  auto block = builder.GetInsertBlock();
+  tail_loop->destination->addIncoming(destination, block);
+  for (std::size_t i = 0; i < arguments.size(); ++i) {
+    tail_loop->parameters[i]->addIncoming(arguments[i], block);
+  }
+  builder.CreateBr(tail_loop->loop_block);
+}
+
 Value* Compiler::constant_i32(int n) {
   return ConstantInt::get(Type::getInt32Ty(context), n);
 }
 
+Value* Compiler::entry_array(std::size_t n) {
+  auto&& entry = builder.GetInsertBlock()->getParent()->getEntryBlock();
+  IRBuilder<> entry_builder {&entry, entry.begin()};
+  return entry_builder.CreateAlloca(object_type, constant_i32(n));
+}
+
+Value* Compiler::constant_i64(std::uint64_t n) {
+  return ConstantInt::get(Type::getInt64Ty(context), n);
+}
+
 void Compiler::operator()(LambdaForm& f) {
   // Get the free vars of the body
+  auto collect_start = std::chrono::steady_clock::now();
   FreeVarCollector collector {
     [&](auto&& s) {
       return globals.find(s) != globals.end();
     }
   };
   collector.collect(f);
+  free_var_time += std::chrono::steady_clock::now() - collect_start;
   // Now filter out all the free variables that are
   // mapped to function*'s
   std::vector<Symbol> fvs {};
@@ -416,17 +781,21 @@ void Compiler::operator()(LambdaForm& f) {
   std::vector<Type*> parameter_types {1+f.parameters.size(), object_type};
   parameter_types[0] = PointerType::getUnqual(object_type);
   auto type = FunctionType::get(object_type, parameter_types, false);
-  Function* fn = Function::Create(type, Function::ExternalLinkage,
-				  "lambda", module);  
+  // instrumented lambdas are looked up by name after linking, see
+  // compile_closure_call
+  Function* fn = closure_code(type, lambda_name(f.position));
   auto before_insert_block = builder.GetInsertBlock();  
   auto lambda_insert_block = BasicBlock::Create(context, "entry", fn);
   builder.SetInsertPoint(lambda_insert_block);
+  enter_function(fn, f.position);
+  count_entry(fn);
   // Setting up the locals
   locals.push_scope();
   // Set up the free vars to fetch the value from the fv array
   for (int i = 0; i < fvs.size(); ++i) {
     auto idx = constant_i32(i);
-    auto fv_val = builder.CreateCall(get_fv_function, {fn->getArg(0), idx});
+    auto fv_ptr = builder.CreateGEP(object_type, fn->getArg(0), {idx});
+    auto fv_val = builder.CreateLoad(object_type, fv_ptr);
     locals.set(fvs[i], fv_val);
   }
   // Set up regular parameters
@@ -437,13 +806,13 @@ void Compiler::operator()(LambdaForm& f) {
   }
   // Now recursively compile the body
   builder.CreateRet(compile(*f.body));
+  leave_function();
   locals.pop_scope();
   builder.SetInsertPoint(before_insert_block);
   
   // Now that we've compiled the body, we need to create
   // an array of the free vars and then we can create a closure
-  auto arr =
-    builder.CreateAlloca(object_type, constant_i32(fvs.size()));
+  auto arr = entry_array(fvs.size());
 
   for (int i = 0; i < fvs.size(); ++i) {
     Value* idx = constant_i32(i);
@@ -466,12 +835,172 @@ void Compiler::operator()(LambdaForm& f) {
 			    constant_i32(f.parameters.size())});
 }
 
+// Compiles a form used as the condition of an if to an i1 that is
+// true if the form is non-nil. Comparisons and type predicates that
+// are applied directly are lowered to compares on the unboxed
+// representation, so no t or nil object is created for them.
+Value* Compiler::compile_condition(Form& f) {
+  auto application = Discriminator<ApplicationForm>::as(f);
+  Function* callee = nullptr;
+  if (application) {
+    auto symbol_form =
+      Discriminator<SymbolForm>::as(*application->function_form);
+    auto it = symbol_form ? lookup(symbol_form->symbol) : nullptr;
+    if (it && std::holds_alternative<Function*>(*it)) {
+      callee = std::get<Function*>(*it);
+    }
+  }
+  if (!callee || application->arg_forms.size() != callee->arg_size()) {
+    auto is_nil = builder.CreateCall(is_nil_function, {compile(f)});
+    return builder.CreateNot(is_nil, "cond");
+  }
+
+  std::vector<Value*> args;
+  for (auto&& arg_form : application->arg_forms) {
+    args.push_back(compile(*arg_form));
+  }
+  if (auto it = comparisons.find(callee); it != comparisons.end()) {
+    return compile_comparison(callee, it->second, args[0], args[1]);
+  }
+  if (auto it = type_predicates.find(callee); it != type_predicates.end()) {
+    auto tag = builder.CreateExtractValue(args[0], 0);
+    auto is_type = builder.CreateICmpEQ(tag, constant_i64(it->second), "cond");
+    // numbers, lists and strings have a second representation, whose
+    // tag only has the kind in its low byte
+    Object::Tag other;
+    if (it->second == Object::tag_number) {
+      other = Object::tag_fixnum;
+    } else if (it->second == Object::tag_cons) {
+      other = Object::tag_compact;
+    } else if (it->second == Object::tag_string) {
+      other = Object::tag_short_string;
+    } else {
+      return is_type;
+    }
+    auto is_other =
+      builder.CreateICmpEQ(builder.CreateAnd(tag, constant_i64(0xff)),
+			   constant_i64(other));
+    return builder.CreateOr(is_type, is_other, "cond");
+  }
+  if (callee == null_p_function) {
+    return builder.CreateCall(is_nil_function, args, "cond");
+  }
+  if (callee == equal_function) {
+    return builder.CreateCall(is_equal_function, args, "cond");
+  }
+  auto is_nil = builder.CreateCall(is_nil_function,
+				   {builder.CreateCall(callee, args)});
+  return builder.CreateNot(is_nil, "cond");
+}
+
+// the integer compare that corresponds to an ordered float compare
+static CmpInst::Predicate signed_predicate(CmpInst::Predicate predicate) {
+  switch (predicate) {
+  case CmpInst::FCMP_OLT: return CmpInst::ICMP_SLT;
+  case CmpInst::FCMP_OGT: return CmpInst::ICMP_SGT;
+  case CmpInst::FCMP_OLE: return CmpInst::ICMP_SLE;
+  case CmpInst::FCMP_OGE: return CmpInst::ICMP_SGE;
+  default: return CmpInst::ICMP_EQ;
+  }
+}
+
+Value* Compiler::both_tagged(Value* lhs, Value* rhs, Object::Tag tag) {
+  auto tag_value = constant_i64(tag);
+  return builder.CreateAnd(builder.CreateICmpEQ(builder.CreateExtractValue(lhs, 0),
+						tag_value),
+			   builder.CreateICmpEQ(builder.CreateExtractValue(rhs, 0),
+						tag_value));
+}
+
+Value* Compiler::compile_comparison(Function* boxed,
+				    CmpInst::Predicate predicate,
+				    Value* lhs, Value* rhs) {
+  auto curr_fn = builder.GetInsertBlock()->getParent();
+  auto fixnum_block = BasicBlock::Create(context, "compare-fixnums", curr_fn);
+  auto check_block = BasicBlock::Create(context, "check-numbers", curr_fn);
+  auto fast_block = BasicBlock::Create(context, "compare-numbers", curr_fn);
+  auto slow_block = BasicBlock::Create(context, "compare-boxed", curr_fn);
+  auto after_block = BasicBlock::Create(context, "after-compare", curr_fn);
+  builder.CreateCondBr(both_tagged(lhs, rhs, Object::tag_fixnum),
+		       fixnum_block, check_block, likely_weights);
+
+  builder.SetInsertPoint(fixnum_block);
+  auto fixnum_res =
+    builder.CreateICmp(signed_predicate(predicate),
+		       builder.CreateExtractValue(lhs, 1),
+		       builder.CreateExtractValue(rhs, 1));
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(check_block);
+  builder.CreateCondBr(both_tagged(lhs, rhs, Object::tag_number),
+		       fast_block, slow_block, likely_weights);
+
+  builder.SetInsertPoint(fast_block);
+  auto double_type = Type::getDoubleTy(context);
+  auto fast_res =
+    builder.CreateFCmp(predicate,
+		       builder.CreateBitCast(builder.CreateExtractValue(lhs, 1),
+					     double_type),
+		       builder.CreateBitCast(builder.CreateExtractValue(rhs, 1),
+					     double_type));
+  builder.CreateBr(after_block);
+
+  // mixed or not numbers, leave it to the runtime (which will report
+  // the type error)
+  builder.SetInsertPoint(slow_block);
+  auto is_nil = builder.CreateCall(is_nil_function,
+				   {builder.CreateCall(boxed, {lhs, rhs})});
+  auto slow_res = builder.CreateNot(is_nil);
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(after_block);
+  auto phi = builder.CreatePHI(Type::getInt1Ty(context), 3, "cond");
+  phi->addIncoming(fixnum_res, fixnum_block);
+  phi->addIncoming(fast_res, fast_block);
+  phi->addIncoming(slow_res, slow_block);
+  return phi;
+}
+
+// Adds, subtracts or multiplies two fixnums inline. Anything else,
+// including an overflow, goes to the runtime, which promotes to
+// double.
+Value* Compiler::compile_arithmetic(Function* boxed, Intrinsic::ID id,
+				    Value* lhs, Value* rhs) {
+  auto curr_fn = builder.GetInsertBlock()->getParent();
+  auto fixnum_block = BasicBlock::Create(context, "fixnum-op", curr_fn);
+  auto done_block = BasicBlock::Create(context, "fixnum-result", curr_fn);
+  auto slow_block = BasicBlock::Create(context, "boxed-op", curr_fn);
+  auto after_block = BasicBlock::Create(context, "after-op", curr_fn);
+  builder.CreateCondBr(both_tagged(lhs, rhs, Object::tag_fixnum),
+		       fixnum_block, slow_block, likely_weights);
+
+  builder.SetInsertPoint(fixnum_block);
+  auto i64_type = Type::getInt64Ty(context);
+  auto op = Intrinsic::getDeclaration(module, id, {i64_type});
+  auto with_overflow = builder.CreateCall(op, {builder.CreateExtractValue(lhs, 1),
+					       builder.CreateExtractValue(rhs, 1)});
+  builder.CreateCondBr(builder.CreateExtractValue(with_overflow, 1),
+		       slow_block, done_block, unlikely_weights);
+
+  builder.SetInsertPoint(done_block);
+  auto fixnum_res =
+    builder.CreateInsertValue(object_constant(Object::fixnum(0)),
+			      builder.CreateExtractValue(with_overflow, 0), 1);
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(slow_block);
+  auto slow_res = builder.CreateCall(boxed, {lhs, rhs});
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(after_block);
+  auto phi = builder.CreatePHI(object_type, 2);
+  phi->addIncoming(fixnum_res, done_block);
+  phi->addIncoming(slow_res, slow_block);
+  return phi;
+}
+
 void Compiler::operator()(IfForm& f) {
-  // compile the condition, then check if it is nil
-  auto condition_code =
-    builder.CreateCall(is_nil_function,
-		       {compile(*f.cond_form)},
-		       "cond");
+  auto condition_code = compile_condition(*f.cond_form);
 
   // create blocks
   auto then_block = BasicBlock::Create(context, "then-block");
@@ -479,8 +1008,7 @@ void Compiler::operator()(IfForm& f) {
   auto after_block = BasicBlock::Create(context, "after-block");
 
   // note order: first block is for true, second is for false
-  // is-nil = true => goto else; is-nil = false => goto then;
-  builder.CreateCondBr(condition_code, else_block, then_block);
+  branch(condition_code, then_block, else_block, f.position);
 
   // get the current function we are emitting code to
   auto curr_fn = builder.GetInsertBlock()->getParent();
@@ -512,38 +1040,97 @@ void Compiler::operator()(QuoteForm& f) {
   std::function<Value*(const Object&)>
     rec = [&](auto&& o) -> Value* {
       if (o.is_number()) {
-	NumberForm f {o.as_number()};
-	return compile(f);
+	return object_constant(o);
       }
       if (o.is_symbol()) {
-	auto c = ConstantDataArray::getString(context, *o.as_symbol());
-	auto gv = new GlobalVariable{module,
+	auto c = ConstantDataArray::getString(context, o.as_symbol()->name());
+	// private, so the JIT doesn't expect a definition for it
+	auto gv = new GlobalVariable{*module,
 				     c->getType(),
 				     true,
-				     GlobalValue::ExternalLinkage, c};
+				     GlobalValue::PrivateLinkage, c,
+				     Twine{"symbol."}.concat(o.as_symbol()->name())};
 	auto gvc = builder.CreateBitCast(gv, Type::getInt8PtrTy(context));
 	return builder.CreateCall(make_symbol_function, {gvc});
       }
-      return builder.CreateCall(cons_function, {rec(o.car()), rec(o.cdr())});
+      if (o.is_string()) {
+	return string_constant(o);
+      }
+      // lists are built in one go by the runtime, so that they come
+      // out compact if compact lists are enabled
+      std::vector<Value*> elements;
+      auto p = o;
+      for (; p.is_cons(); p = p.cdr()) {
+	elements.push_back(rec(p.car()));
+      }
+      auto tail = rec(p);
+      auto arr = entry_array(elements.size());
+      for (std::size_t i = 0; i < elements.size(); ++i) {
+	builder.CreateStore(elements[i],
+			    builder.CreateGEP(object_type, arr, {constant_i32(i)}));
+      }
+      return builder.CreateCall(make_list_function,
+				{arr, constant_i64(elements.size()), tail});
     };
   res = rec(f.arg);
   // throw std::runtime_error("can't handle");
 }
 
+// An object that holds all of its value in itself (a number, fixnum or
+// short string) as a constant.
+Constant* Compiler::object_constant(const Object& o) {
+  auto i64_type = Type::getInt64Ty(context);
+  std::uint64_t words[2];
+  static_assert(sizeof words == sizeof o);
+  std::memcpy(words, &o, sizeof o);
+  return ConstantStruct::get(cast<StructType>(object_type),
+			     {ConstantInt::get(i64_type, words[0]),
+			      ConstantInt::get(i64_type, words[1])});
+}
+
+// Strings are immutable, so a literal is a constant: a short string is
+// the object itself, a longer one points to a StringData in the
+// module's constants.
+Constant* Compiler::string_constant(const Object& o) {
+  auto i64_type = Type::getInt64Ty(context);
+  if (o.kind() == Object::tag_short_string) {
+    return object_constant(o);
+  }
+  auto s = o.as_string();
+  auto c = ConstantStruct::getAnon({ConstantInt::get(i64_type, s.size()),
+				    ConstantDataArray::getString(context, s, false)});
+  auto gv = new GlobalVariable{*module,
+			       c->getType(),
+			       true,
+			       GlobalValue::PrivateLinkage, c,
+			       "string"};
+  gv->setAlignment(Align(alignof(StringData)));
+  return ConstantStruct::get(cast<StructType>(object_type),
+			     {ConstantInt::get(i64_type, Object::tag_string),
+			      ConstantExpr::getPtrToInt(gv, i64_type)});
+}
+
 void Compiler::operator()(SymbolForm& f) {
   auto&& it = lookup(f.symbol);
   if (!it) { throw std::runtime_error("couldn't find variable");}
       
   if (std::holds_alternative<Value*>(*it)) {
     res = std::get<Value*>(*it);
+  } else if (std::holds_alternative<GlobalVariable*>(*it)) {
+    res = builder.CreateLoad(object_type, std::get<GlobalVariable*>(*it));
   } else {
-    throw std::runtime_error("can handle this");
+    // a letrec function without free variables, or a primitive; the
+    // ones with free variables are renamed to their closure by the
+    // letrec
+    res = static_closure(std::get<Function*>(*it));
   }
 }
 
 void Compiler::operator()(NumberForm& f) {
-  auto n = ConstantFP::get(context, APFloat(f.number));
-  res = builder.CreateCall(make_number_function, {n});
+  // numbers are unboxed, so build the object as a constant; that lets
+  // the tag checks of compile_comparison and compile_arithmetic fold
+  // away for literals
+  res = object_constant(f.number);
 }
 
 void Compiler::operator()(ApplicationForm& f) {
@@ -563,10 +1150,14 @@ void Compiler::operator()(ApplicationForm& f) {
       for (auto&& arg_form : f.arg_forms) {
 	arg_values.push_back(compile(*arg_form));
       }
+      if (auto it = arithmetic.find(callee); it != arithmetic.end()) {
+	res = compile_arithmetic(callee, it->second, arg_values[0], arg_values[1]);
+	return;
+      }
       res = builder.CreateCall(callee, arg_values);
       return;
     } else {
-      head = std::get<Value*>(*it);
+      head = compile(*symbol_form);
     }
   } else {
     head = compile(*f.function_form);
@@ -578,12 +1169,273 @@ void Compiler::operator()(ApplicationForm& f) {
   for (auto&& arg : f.arg_forms) {
     arg_values.push_back(compile(*arg));
   }
-  res = builder.CreateCall(call_closure_function(f.arg_forms.size()),
-			   arg_values);		     
+  res = compile_closure_call(arg_values, f.position);
+}
+
+std::string Compiler::profile_key(const char* kind, SourcePosition position) {
+  return std::string{kind} + " " + std::to_string(position.line)
+    + ":" + std::to_string(position.column);
+}
+
+void Compiler::increment(std::uint64_t* counter, Value* amount) {
+  auto i64_type = Type::getInt64Ty(context);
+  auto address =
+    builder.CreateIntToPtr(constant_i64(reinterpret_cast<std::uintptr_t>(counter)),
+			   PointerType::getUnqual(i64_type));
+  builder.CreateAtomicRMW(AtomicRMWInst::Add, address,
+			  amount ? amount : constant_i64(1),
+			  MaybeAlign(8), AtomicOrdering::Monotonic);
+}
+
+MDNode* Compiler::branch_weights(std::uint64_t taken, std::uint64_t not_taken) {
+  // the weights are 32 bit
+  auto scale = std::max(taken, not_taken) / std::numeric_limits<std::uint32_t>::max() + 1;
+  return MDBuilder{context}.createBranchWeights(taken / scale, not_taken / scale);
+}
+
+void Compiler::count_entry(Function* fn) {
+  if (!profile) return;
+  auto key = "entry " + fn->getName().str();
+  if (instrument) {
+    increment(profile->counter(key));
+  } else if (auto count = profile->count(key)) {
+    fn->setEntryCount(*count);
+  }
+}
+
+// The branch of an if: instrumented code counts which way it goes,
+// with a profile the counts become its weights.
+void Compiler::branch(Value* condition, BasicBlock* then_block,
+		      BasicBlock* else_block, SourcePosition position) {
+  if (!profile || position.line == 0) {
+    builder.CreateCondBr(condition, then_block, else_block);
+    return;
+  }
+  auto key = profile_key("if", position);
+  if (instrument) {
+    // counted before branching, with the condition as the amount, so
+    // the branches get no blocks of their own; the calls in them that
+    // are in tail position stay tail calls because compile_closure_call
+    // marks them
+    auto i64_type = Type::getInt64Ty(context);
+    increment(profile->counter(key + " then"),
+	      builder.CreateZExt(condition, i64_type));
+    increment(profile->counter(key + " else"),
+	      builder.CreateZExt(builder.CreateNot(condition), i64_type));
+    builder.CreateCondBr(condition, then_block, else_block);
+    return;
+  }
+  auto then_count = profile->count(key + " then");
+  auto else_count = profile->count(key + " else");
+  builder.CreateCondBr(condition, then_block, else_block,
+		       then_count && else_count
+		       ? branch_weights(*then_count, *else_count)
+		       : nullptr);
 }
 
-void Compiler::print_code() {
-  builder.CreateRetVoid();
+// Calls the closure arg_values[0]. Instrumented code records which
+// lambda it is. With a profile, a call site that mostly calls the
+// same lambda checks for its code and calls it directly, where it
+// can be inlined; the lambda is only known by name here, so the call
+// goes to a stand-in that finish_module replaces.
+//
+// The calls are marked tail (closures never see the caller's stack),
+// which lets code generation turn one in tail position into a jump
+// even where the result comes back through the phi of a promoted
+// call: a loop of closure calls runs in constant stack with a profile
+// as it does without.
+Value* Compiler::compile_closure_call(std::vector<Value*>& arg_values,
+				      SourcePosition position) {
+  auto n = arg_values.size() - 1;
+  auto&& generic_call = [&]() -> Value* {
+    auto call = builder.CreateCall(call_closure_function(n), arg_values);
+    call->setTailCall();
+    return call;
+  };
+  if (!profile || position.line == 0) {
+    return generic_call();
+  }
+  auto key = profile_key("call", position);
+  if (instrument) {
+    auto site =
+      builder.CreateIntToPtr(constant_i64(reinterpret_cast<std::uintptr_t>
+					  (profile->call_site(key))),
+			     Type::getInt8PtrTy(context));
+    builder.CreateCall(profile_call_function, {site, arg_values[0]});
+    return generic_call();
+  }
+  auto target = profile->dominant_target(key, promotion_share);
+  if (!target) {
+    return generic_call();
+  }
+  auto&& stand_in = promotions[target->name];
+  if (!stand_in) {
+    std::vector<Type*> parameter_types {n+1, object_type};
+    parameter_types[0] = PointerType::getUnqual(object_type);
+    stand_in = Function::Create(FunctionType::get(object_type, parameter_types, false),
+				Function::ExternalLinkage,
+				"promoted." + target->name, *module);
+  }
+  if (stand_in->arg_size() != n+1) {
+    return generic_call();
+  }
+
+  auto closure = arg_values[0];
+  auto curr_fn = builder.GetInsertBlock()->getParent();
+  auto check_block = BasicBlock::Create(context, "check-code", curr_fn);
+  auto direct_block = BasicBlock::Create(context, "direct-call", curr_fn);
+  auto generic_block = BasicBlock::Create(context, "generic-call", curr_fn);
+  auto after_block = BasicBlock::Create(context, "after-call", curr_fn);
+  auto is_closure =
+    builder.CreateICmpEQ(builder.CreateExtractValue(closure, 0),
+			 constant_i64(Object::tag_closure));
+  builder.CreateCondBr(is_closure, check_block, generic_block, likely_weights);
+
+  builder.SetInsertPoint(check_block);
+  auto header_type = closure_header_type();
+  auto header =
+    builder.CreateIntToPtr(builder.CreateExtractValue(closure, 1),
+			   PointerType::getUnqual(header_type));
+  auto code =
+    builder.CreateLoad(Type::getInt8PtrTy(context),
+		       builder.CreateStructGEP(header_type, header, 0), "code");
+  auto is_target =
+    builder.CreateICmpEQ(code, builder.CreateBitCast(stand_in, Type::getInt8PtrTy(context)));
+  builder.CreateCondBr(is_target, direct_block, generic_block,
+		       branch_weights(target->count, target->total - target->count));
+
+  builder.SetInsertPoint(direct_block);
+  std::vector<Value*> arguments {arg_values};
+  arguments[0] =
+    builder.CreateBitCast(builder.CreateConstGEP1_32(header_type, header, 1),
+			  PointerType::getUnqual(object_type), "fvs");
+  auto direct_res = builder.CreateCall(stand_in, arguments);
+  direct_res->setTailCall();
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(generic_block);
+  auto generic_res = generic_call();
+  builder.CreateBr(after_block);
+
+  builder.SetInsertPoint(after_block);
+  auto phi = builder.CreatePHI(object_type, 2);
+  phi->addIncoming(direct_res, direct_block);
+  phi->addIncoming(generic_res, generic_block);
+  return phi;
+}
+
+// ClosureData is {i8* code; i32 n_params; i32 n_fvs} followed by the
+// free variables
+StructType* Compiler::closure_header_type() {
+  auto i32_type = Type::getInt32Ty(context);
+  return StructType::get(Type::getInt8PtrTy(context), i32_type, i32_type);
+}
+
+Function* Compiler::closure_code(FunctionType* type, std::string name) {
+  if (export_lambdas) {
+    name = module->getName().str() + "." + name;
+  }
+  Function* fn = Function::Create(type,
+				  instrument || export_lambdas
+				  ? Function::ExternalLinkage
+				  : Function::InternalLinkage,
+				  name, *module);
+  if (instrument) {
+    instrumented_lambdas.push_back(fn->getName().str());
+  }
+  return fn;
+}
+
+Function* Compiler::closure_adapter(Function* fn, std::size_t n_params) {
+  std::vector<Type*> parameter_types {1+n_params, object_type};
+  parameter_types[0] = PointerType::getUnqual(object_type);
+  auto type = FunctionType::get(object_type, parameter_types, false);
+  auto adapter = closure_code(type, fn->getName().str() + ".closure");
+  auto before_insert_block = builder.GetInsertBlock();
+  builder.SetInsertPoint(BasicBlock::Create(context, "entry", adapter));
+  enter_function(adapter, {});
+  std::vector<Value*> arguments;
+  for (std::size_t i = 0; i < n_params; ++i) {
+    arguments.push_back(adapter->getArg(1+i));
+  }
+  for (std::size_t i = 0; i < fn->arg_size() - n_params; ++i) {
+    auto fv_ptr = builder.CreateGEP(object_type, adapter->getArg(0),
+				    {constant_i32(i)});
+    arguments.push_back(builder.CreateLoad(object_type, fv_ptr));
+  }
+  builder.CreateRet(builder.CreateCall(fn, arguments));
+  leave_function();
+  builder.SetInsertPoint(before_insert_block);
+  return adapter;
+}
+
+Constant* Compiler::static_closure(Function* fn) {
+  if (auto it = static_closures.find(fn); it != static_closures.end()) {
+    return it->second;
+  }
+  auto i32_type = Type::getInt32Ty(context);
+  auto i64_type = Type::getInt64Ty(context);
+  auto header_type = closure_header_type();
+  auto adapter = closure_adapter(fn, fn->arg_size());
+  auto header =
+    ConstantStruct::get(header_type,
+			{ConstantExpr::getBitCast(adapter, Type::getInt8PtrTy(context)),
+			 ConstantInt::get(i32_type, fn->arg_size()),
+			 ConstantInt::get(i32_type, 0)});
+  auto gv = new GlobalVariable{*module,
+			       header_type,
+			       true,
+			       GlobalValue::PrivateLinkage, header,
+			       fn->getName() + ".closure"};
+  gv->setAlignment(Align(alignof(ClosureData)));
+  auto closure =
+    ConstantStruct::get(cast<StructType>(object_type),
+			{ConstantInt::get(i64_type, Object::tag_closure),
+			 ConstantExpr::getPtrToInt(gv, i64_type)});
+  static_closures[fn] = closure;
+  return closure;
+}
+
+void Compiler::finish_module() {
+  builder.CreateRet(res);
+  leave_function();
+  if (debug_info) {
+    di_builder->finalize();
+  }
+
+  // a promoted closure call calls its lambda directly if that was
+  // compiled into this module, otherwise the check for it can't
+  // succeed
+  for (auto&& [name, stand_in] : promotions) {
+    auto target = module->getFunction(name);
+    if (target && !target->isDeclaration()
+	&& target->getFunctionType() == stand_in->getFunctionType()) {
+      stand_in->replaceAllUsesWith(target);
+    } else {
+      stand_in->replaceAllUsesWith(ConstantPointerNull::get(stand_in->getType()));
+    }
+    stand_in->eraseFromParent();
+  }
+  promotions.clear();
+
+  // lets the inliner and block placement tell hot from cold code
+  if (profile && !instrument) {
+    auto&& cutoffs = ProfileSummaryBuilder::DefaultCutoffs;
+    InstrProfSummaryBuilder summary {{cutoffs.begin(), cutoffs.end()}};
+    for (auto&& [key, count] : profile->all_counts()) {
+      summary.addRecord(InstrProfRecord{{count}});
+    }
+    module->setProfileSummary(summary.getSummary()->getMD(context),
+			      ProfileSummary::PSK_Instr);
+  }
+
+  // runtime errors are C++ exceptions thrown through the generated
+  // code, which needs unwind tables for that
+  for (auto&& fn : *module) {
+    if (!fn.isDeclaration()) {
+      fn.setUWTableKind(UWTableKind::Default);
+    }
+  }
 
   if (optimize) {
     // Create the analysis managers.
@@ -596,7 +1448,12 @@ void Compiler::print_code() {
     // Take a look at the PassBuilder constructor parameters for more
     // customization, e.g. specifying a TargetMachine or various debugging
     // options.
-    PassBuilder PB;
+    // The call graph profile that entry counts from -profile-use
+    // would produce is a section for the static linker, which the JIT
+    // linker doesn't take.
+    PipelineTuningOptions PTO;
+    PTO.CallGraphProfile = false;
+    PassBuilder PB {nullptr, PTO};
 
     // Register all the basic analyses with the managers.
     PB.registerModuleAnalyses(MAM);
@@ -608,9 +1465,17 @@ void Compiler::print_code() {
     // Create the pass manager.
     // This one corresponds to a typical -O2 optimization pipeline.
     ModulePassManager MPM = PB.buildPerModuleDefaultPipeline(OptimizationLevel::O2);
-    MPM.run(module, MAM);
+    MPM.run(*module, MAM);
   }
-  module.print(outs(), nullptr);
+}
+
+orc::ThreadSafeModule Compiler::take_module() {
+  // the module is going into the JIT, its definitions can be referred
+  // to from now on
+  definitions.insert(definitions.end(),
+		     pending_definitions.begin(), pending_definitions.end());
+  pending_definitions.clear();
+  return {std::move(module_ptr), ts_context};
 }
 
 Function* Compiler::call_closure_function(int n) {
@@ -627,15 +1492,47 @@ Function* Compiler::call_closure_function(int n) {
 		      std::vector{static_cast<unsigned>(n+1), object_type},
 		      false);
   auto fn =
-    Function::Create(this_fn_type, Function::ExternalLinkage,
-		     {"call_closure", std::to_string(n)}, module);
+    Function::Create(this_fn_type, Function::InternalLinkage,
+		     {"call_closure", std::to_string(n)}, *module);
   auto block = BasicBlock::Create(context, "entry", fn);
   builder.SetInsertPoint(block); 
+  enter_function(fn, {});
+
+  // check the header of the closure inline: it must be tagged as a
+  // closure and take exactly n parameters, anything else goes to the
+  // (cold, non-returning) error routine
+  auto closure = fn->getArg(0);
+  auto header_block = BasicBlock::Create(context, "check-arity", fn);
+  auto call_block = BasicBlock::Create(context, "call", fn);
+  auto error_block = BasicBlock::Create(context, "call-error", fn);
+  auto is_closure =
+    builder.CreateICmpEQ(builder.CreateExtractValue(closure, 0),
+			 constant_i64(Object::tag_closure));
+  builder.CreateCondBr(is_closure, header_block, error_block, likely_weights);
+
+  builder.SetInsertPoint(header_block);
+  auto i32_type = Type::getInt32Ty(context);
+  auto char_ptr_type = Type::getInt8PtrTy(context);
+  auto header_type = closure_header_type();
+  auto header =
+    builder.CreateIntToPtr(builder.CreateExtractValue(closure, 1),
+			   PointerType::getUnqual(header_type));
+  auto n_params =
+    builder.CreateLoad(i32_type, builder.CreateStructGEP(header_type, header, 1),
+		       "n-params");
+  builder.CreateCondBr(builder.CreateICmpEQ(n_params, constant_i32(n)),
+		       call_block, error_block, likely_weights);
+
+  builder.SetInsertPoint(error_block);
+  builder.CreateCall(call_error_function, {closure, constant_i32(n)});
+  builder.CreateUnreachable();
 
-  // get_code returns an i8*, cast it to a pointer to a
+  // cast the code to a pointer to a
   // Object (Object*, Object, ..., Object)
+  builder.SetInsertPoint(call_block);
   auto code =
-    builder.CreateCall(get_code_function, {fn->getArg(0), constant_i32(n)});
+    builder.CreateLoad(char_ptr_type, builder.CreateStructGEP(header_type, header, 0),
+		       "code");
   auto fnptr_parameter_types = std::vector(static_cast<unsigned>(n+1), object_type);
   fnptr_parameter_types[0] = PointerType::getUnqual(object_type);
   auto fn_type = FunctionType::get(object_type, fnptr_parameter_types, false);
@@ -644,7 +1541,8 @@ Function* Compiler::call_closure_function(int n) {
 
   // Now set up the arguments to call the code
   auto fvs =
-    builder.CreateCall(get_fvs_function, {fn->getArg(0)});
+    builder.CreateBitCast(builder.CreateConstGEP1_32(header_type, header, 1),
+			  PointerType::getUnqual(object_type), "fvs");
   std::vector<Value*> arguments;
   arguments.push_back(fvs);
   for (auto it = fn->arg_begin()+1; it != fn->arg_end(); ++it) {
@@ -652,7 +1550,9 @@ Function* Compiler::call_closure_function(int n) {
   }
 
   auto ret = builder.CreateCall(fn_type, fnptr, arguments);
+  ret->setTailCall();
   builder.CreateRet(ret);    
+  leave_function();
   builder.SetInsertPoint(before_insert_block);
   return fn;
 }
@@ -1,4 +1,6 @@
 #include "decls.hpp"
+#include "profile.hpp"
+#include <chrono>
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
@@ -6,10 +8,14 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
+#include "llvm/IR/DIBuilder.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/ExecutionEngine/Orc/ThreadSafeModule.h"
 
 
 using namespace llvm;
@@ -50,40 +56,96 @@ struct ScopeStack {
 
 struct Compiler : public FormVisitor {
 
-  using VariableEntry = std::variant<Value*, Function*>;
+  // Value*: an SSA value, Function*: a function called directly,
+  // GlobalVariable*: a top-level definition, loaded on every use
+  using VariableEntry = std::variant<Value*, Function*, GlobalVariable*>;
   ScopeStack<VariableEntry> locals {};
   std::unordered_map<Symbol, VariableEntry> globals {};
 
   const VariableEntry* lookup(Symbol s);
+  // whether a global refers to one of the runtime's functions
+  bool is_primitive(Symbol s);
   
-  std::unique_ptr<LLVMContext> context_ptr
-    {std::make_unique<LLVMContext>()};
-  LLVMContext& context {*context_ptr};
-  std::unique_ptr<Module> module_ptr
-    {std::make_unique<Module>("test", context)};
-  Module& module {*module_ptr};
+  // one context for the whole session, shared by every module
+  orc::ThreadSafeContext ts_context {std::make_unique<LLVMContext>()};
+  LLVMContext& context {*ts_context.getContext()};
+  std::unique_ptr<Module> module_ptr;
+  Module* module;
   IRBuilder<> builder {context};
 
+  // top-level definitions already handed to the JIT, and the ones made
+  // by the module being compiled
+  std::vector<Symbol> definitions {};
+  std::vector<Symbol> pending_definitions {};
+  std::string definition_name(Symbol s);
+
   // PassBuilder pass_builder {};
   // ModulePassManager module_pm;
   
-  Function* main;
+  // the function the module's code is compiled into
+  Function* entry;
   Type* object_type;
   Function* make_number_function;
   Function* make_symbol_function;
   Function* is_nil_function;
   Function* cons_function;
-  Function* get_code_function;
-  Function* get_fvs_function;
-  Function* get_fv_function;
+  Function* make_list_function;
+  Function* call_error_function;
+  // branch weights for checks whose false edge leads to an error or
+  // to the boxed slow path
+  MDNode* likely_weights;
+  MDNode* unlikely_weights;
   Function* create_closure_function;
+  Function* is_equal_function;
+  Function* equal_function;
+  Function* null_p_function;
+  // primitives that compile_condition lowers without boxing the result
+  std::unordered_map<Function*, CmpInst::Predicate> comparisons {};
+  // primitives whose fixnum case is compiled inline, with the
+  // overflow-checked intrinsic for it
+  std::unordered_map<Function*, Intrinsic::ID> arithmetic {};
+  std::unordered_map<Function*, Object::Tag> type_predicates {};
   bool optimize;
 
-  Compiler(bool optimize);
+  // time the module spent collecting free variables and injecting
+  // them into calls of letrec functions, which -time reports apart
+  // from the rest of compiling
+  std::chrono::steady_clock::duration free_var_time {};
+  std::chrono::steady_clock::duration inject_time {};
+
+  // binder of the innermost let/letrec binding being compiled, used
+  // to give lambdas names that can be traced back to the source
+  Symbol enclosing_binder {nullptr};
+  std::string lambda_name(SourcePosition position);
+
+  // DWARF line info, only emitted if debug_info is set
+  bool debug_info;
+  std::unique_ptr<DIBuilder> di_builder;
+  DIFile* di_file;
+  DISubroutineType* di_function_type;
+  std::vector<std::pair<DIScope*, DebugLoc>> di_scopes {};
+  void enter_function(Function* fn, SourcePosition position);
+  void leave_function();
+  void set_location(SourcePosition position);
+
+  Compiler(bool optimize, bool debug_info);
+
+  // Each top-level form is compiled into its own module: begin_module
+  // sets up a module with an entry function called entry_name,
+  // finish_module returns the last value compiled from it and runs
+  // the optimizer, take_module hands it over to the JIT.
+  void begin_module(const std::string& entry_name);
+  void finish_module();
+  orc::ThreadSafeModule take_module();
+  // (define s f) at the top level
+  void define(Symbol s, Form& f);
   
   Value* res;
   Value* compile(Form& f) {
+    auto saved_location = builder.getCurrentDebugLocation();
+    set_location(f.position);
     f.accept(*this);
+    builder.SetCurrentDebugLocation(saved_location);
     return res;
   }
   void operator()(NumberForm& f) override;
@@ -94,9 +156,90 @@ struct Compiler : public FormVisitor {
   void operator()(QuoteForm& f) override;
   void operator()(ApplicationForm& f) override;
   void operator()(LambdaForm& f) override;
-  void print_code();
 
+  // A letrec function that calls itself in tail position is compiled
+  // into a loop, so it runs in constant stack with or without the
+  // optimizer. The loop passes the destination of its result along,
+  // which lets a recursive call that is the cdr of a cons in tail
+  // position (tail recursion modulo cons) loop too: each cons cell is
+  // allocated before its cdr is known, and the next iteration stores
+  // the rest of the list into it.
+  struct TailLoop {
+    Function* function;
+    BasicBlock* loop_block;
+    // where the current iteration stores its result
+    PHINode* destination;
+    std::vector<PHINode*> parameters;
+    BasicBlock* exit_block;
+  };
+  TailLoop* tail_loop {nullptr};
+  void compile_loop(Function* fn, FunctionBinding& binding);
+  void compile_tail(Form& f);
+  void jump_to_loop(Value* destination, std::vector<Value*> arguments);
+  // the function a form applies directly, if any
+  Function* direct_callee(ApplicationForm& f);
+
+  Value* compile_condition(Form& f);
+  Value* compile_comparison(Function* boxed, CmpInst::Predicate predicate,
+			    Value* lhs, Value* rhs);
+  Value* compile_arithmetic(Function* boxed, Intrinsic::ID id,
+			    Value* lhs, Value* rhs);
+  // whether both objects have the given tag
+  Value* both_tagged(Value* lhs, Value* rhs, Object::Tag tag);
+
+  // -profile-generate: count function entries, branches and the
+  // lambdas called from closure call sites into profile;
+  // -profile-use: take branch weights, entry counts and the targets
+  // of closure calls from it
+  Profile* profile {nullptr};
+  bool instrument {false};
+  // -save-image: give lambdas external names, prefixed with the
+  // module's so they are unique in the session, by which an image
+  // refers to the code of its closures
+  bool export_lambdas {false};
+  // the REPL links all its modules into one JITDylib: their letrec
+  // functions, which are external, get the module's name as a prefix
+  bool prefix_letrec_names {false};
+  // the module's lambdas, which an instrumented run looks up after
+  // linking to tell the targets of closure calls apart
+  std::vector<std::string> instrumented_lambdas {};
+  // least share of a call site's calls that must go to one lambda for
+  // the site to check for it and call it directly
+  static constexpr double promotion_share = 0.8;
+  // stand-ins for the lambdas promoted calls go to, by name
+  std::unordered_map<std::string, Function*> promotions {};
+  Function* profile_call_function;
+  std::string profile_key(const char* kind, SourcePosition position);
+  // adds amount, or 1, to a profile counter
+  void increment(std::uint64_t* counter, Value* amount = nullptr);
+  MDNode* branch_weights(std::uint64_t taken, std::uint64_t not_taken);
+  void count_entry(Function* fn);
+  void branch(Value* condition, BasicBlock* then_block, BasicBlock* else_block,
+	      SourcePosition position);
+  Value* compile_closure_call(std::vector<Value*>& arg_values,
+			      SourcePosition position);
+  StructType* closure_header_type();
+  // the function for a closure's code, with the name and linkage
+  // instrument and export_lambdas want
+  Function* closure_code(FunctionType* type, std::string name);
+
+  // Letrec functions (and primitives) used as values. A closure's code
+  // takes the free variables as an array, a letrec function takes
+  // them as parameters after its own n_params: the adapter passes them
+  // from one to the other. A function without free variables gets one
+  // closure for the module, a constant that needs no allocation.
+  Function* closure_adapter(Function* fn, std::size_t n_params);
+  std::unordered_map<Function*, Constant*> static_closures {};
+  Constant* static_closure(Function* fn);
+
+  Constant* object_constant(const Object& o);
+  Constant* string_constant(const Object& o);
   Value* constant_i32(int n);
+  Value* constant_i64(std::uint64_t n);
+  // an array of n objects in the current function's entry block, so
+  // that code in a loop reuses it instead of growing the stack; the
+  // runtime copies what it is passed, so each use can refill it
+  Value* entry_array(std::size_t n);
   
   std::unordered_map<int, Function*>
   call_closure_cache;
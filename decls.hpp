@@ -1,27 +1,79 @@
+#pragma once
 #include <string>
+#include <string_view>
+#include <shared_mutex>
+#include <mutex>
 #include <cstdint>
+#include <cstdio>
 #include <iostream>
 #include <list>
 #include <vector>
 #include <unordered_map>
 #include <memory>
 #include <variant>
+#include <thread>
+#include <exception>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <unordered_set>
+#include <type_traits>
+#include <optional>
 
 struct Cell;
 struct ClosureData;
+struct VectorData;
+struct TableData;
+struct ThreadData;
+struct SymbolData;
+struct StringData;
+struct PortData;
 using Cons = Cell*;
 using Closure = ClosureData*;
-using Symbol = const std::string*;
+using Vector = VectorData*;
+using Table = TableData*;
+using Thread = ThreadData*;
+using Symbol = const SymbolData*;
+using String = StringData*;
+using Port = PortData*;
+
+// what the elements of a lazy list read from a port are
+enum class Record { line, datum };
 
 class Object {
-private:
+public:
+  // public so that the compiler can emit inline tag checks
   enum Tag {
+    // a double; integers that fit are fixnums (see tag_fixnum), and
+    // both count as numbers
     tag_number,
     tag_symbol,
     tag_cons,
     tag_closure,
+    tag_vector,
+    tag_table,
+    tag_thread,
+    // an element of a cdr-coded list segment: the elements are stored
+    // one after the other, followed by the tail of the list, and the
+    // upper bits of the tag count the elements left in the segment
+    tag_compact,
+    // strings are immutable and not interned: up to 8 characters are
+    // stored in the data itself, with the length in the upper bits of
+    // the tag, longer ones on the heap
+    tag_string,
+    tag_short_string,
+    // an int64, which arithmetic promotes to a double on overflow
+    tag_fixnum,
+    tag_port,
+    // the unread rest of a list returned by read-lines or read-data,
+    // only ever found in the cdr of a cons: cdr reads the next element
+    // from the port the first time it gets there, with the Record in
+    // the upper bits of the tag
+    tag_stream,
   };
-  
+  static constexpr std::size_t short_string_length = 8;
+private:
   std::uint64_t tag;
   std::uint64_t data;  
 public:
@@ -29,22 +81,61 @@ public:
   explicit Object(Symbol s);
   explicit Object(Cons c);
   explicit Object(Closure c);
+  explicit Object(Vector v);
+  explicit Object(Table t);
+  explicit Object(Thread t);
+  explicit Object(String s);
+  explicit Object(Port p);
+  // the list of the length elements starting at elements, which are
+  // followed by the list's tail
+  static Object compact(Object* elements, std::uint64_t length);
+  // at most short_string_length characters
+  static Object short_string(std::string_view s);
+  static Object fixnum(std::int64_t i);
+  static Object stream(Port p, Record record);
+  // the tag without a compact list's count
+  Tag kind() const { return static_cast<Tag>(tag & 0xff); }
+  // a double or a fixnum
   bool is_number() const;
+  bool is_fixnum() const;
   bool is_symbol() const;
   bool is_cons() const;
   bool is_closure() const;
+  bool is_vector() const;
+  bool is_table() const;
+  bool is_thread() const;
+  bool is_string() const;
+  bool is_port() const;
+  // converts fixnums to double
   double as_number() const;
+  std::int64_t as_fixnum() const;
   Symbol as_symbol() const;
+  // a Cell, so not for compact lists (which are is_cons too)
   Cons as_cons() const;
   Closure as_closure() const;
+  Vector as_vector() const;
+  Table as_table() const;
+  Thread as_thread() const;
+  Port as_port() const;
+  // points into the object itself for short strings
+  std::string_view as_string() const;
   Object& car() const;
-  Object& cdr() const;
+  // by value, compact lists compute their cdr and lazy lists read it
+  Object cdr() const;
   bool is_nil() const;
   friend bool operator==(const Object& o1, const Object& o2);
   friend bool operator!=(const Object& o1, const Object& o2)
   { return !(o1 == o2); }
   friend std::ostream& operator<<(std::ostream& os, Object o);
+  friend class Printer;
+  friend class Image;
+  // replaces the tag_stream cdr of a lazy list
+  friend struct PortData;
   bool equal(const Object& rhs) const;
+  // consistent with equal: by value for numbers (a fixnum equals a
+  // double of the same value), by identity for symbols and closures,
+  // structural for conses, vectors and strings
+  std::uint64_t hash() const;
 };
 
 struct Cell {
@@ -55,34 +146,246 @@ struct Cell {
   {}
 };
 
+// The n_fvs free variables are stored directly after the header.
 struct ClosureData {
   void* code;
-  std::vector<Object> fvs;
-  int n_params;
+  std::int32_t n_params;
+  std::int32_t n_fvs;
   ClosureData(void* code,
-	      std::vector<Object>&& fvs,
-	      int n_params)
-    : code{code}, fvs{std::move(fvs)},
-      n_params{n_params}
+	      std::int32_t n_params,
+	      std::int32_t n_fvs)
+    : code{code}, n_params{n_params}, n_fvs{n_fvs}
+  {}
+  Object* fvs() {
+    return reinterpret_cast<Object*>(this + 1);
+  }
+};
+
+// packed vector of doubles
+struct VectorData {
+  std::vector<double> elements;
+  VectorData(std::vector<double>&& elements)
+    : elements{std::move(elements)}
+  {}
+};
+
+// An interned name. The characters (followed by a nul) are stored
+// directly after the header.
+struct SymbolData {
+  std::uint64_t hash;
+  std::uint32_t length;
+  SymbolData(std::uint64_t hash, std::uint32_t length)
+    : hash{hash}, length{length}
+  {}
+  std::string_view name() const {
+    return {reinterpret_cast<const char*>(this + 1), length};
+  }
+};
+
+// A string too long for a short string. The characters are stored
+// directly after the header.
+struct StringData {
+  std::uint64_t length;
+  StringData(std::uint64_t length)
+    : length{length}
   {}
+  char* chars() {
+    return reinterpret_cast<char*>(this + 1);
+  }
+  std::string_view view() {
+    return {chars(), length};
+  }
 };
 
+// The address range that the blocks of symbols, conses, closures and
+// strings come from. It is reserved at a fixed address if possible, so
+// that an image of it (see image.hpp) can be mapped back in at the same
+// address with every pointer into it still valid. Blocks are handed out
+// one after the other and never freed.
+class Heap {
+private:
+  std::mutex mutex {};
+  char* base;
+  char* next;
+  char* end;
+  bool at_address {false};
+public:
+  static constexpr std::uintptr_t address = 0x200000000000;
+  static constexpr std::size_t reserved = std::size_t{1} << 40;
+  Heap();
+  char* block(std::size_t size);
+  // whether the heap is at address, which images need
+  bool fixed() const { return at_address; }
+  char* begin() const { return base; }
+  // the end of the blocks handed out so far
+  char* used_end();
+  // replaces the start of the heap with size bytes of the file fd from
+  // offset on, which end up being the heap's used part
+  void map(int fd, std::uint64_t offset, std::size_t size);
+};
+
+// Open addressing interning table. Symbols are allocated in an arena of
+// large blocks and never move; the table itself only holds pointers to
+// them and is probed linearly, comparing the precomputed hashes before
+// the names.
+class SymbolTable {
+private:
+  static constexpr std::size_t block_size = 64 * 1024;
+  Heap& heap;
+  char* block_next {nullptr};
+  char* block_end {nullptr};
+  std::vector<Symbol> slots;
+  std::size_t count {0};
+  std::shared_mutex mutex {};
+
+  Symbol find(std::string_view name, std::uint64_t hash) const;
+  Symbol allocate(std::string_view name, std::uint64_t hash);
+  void insert(Symbol s);
+  friend class Image;
+public:
+  SymbolTable(Heap& heap);
+  Symbol intern(std::string_view name);
+};
+
+// Hash table keyed by equal. Open addressing with linear probing, at
+// most half full; there is no removal so no tombstones are needed.
+struct TableData {
+  struct Entry {
+    Object key;
+    Object value;
+    bool used;
+  };
+  std::vector<Entry> entries;
+  std::size_t count {0};
+  TableData();
+  Entry& find(const Object& key, std::uint64_t hash);
+  Object* get(const Object& key);
+  void put(const Object& key, const Object& value);
+};
+
+// A thread running a closure, created by spawn.
+struct ThreadData {
+  Object result;
+  std::exception_ptr error {};
+  std::once_flag joined {};
+  std::thread thread;
+  ThreadData(Object f);
+  ~ThreadData();
+  // waits for the thread to end, without looking at its result
+  void wait();
+  Object join();
+};
+
+// Conses, closures and strings are bump allocated from blocks of the
+// heap. Each thread allocates from a block of its own (see allocate),
+// so the heap's lock is only taken to hand out a new block. The other
+// objects own memory outside the heap and are kept in lists under
+// mutex.
 struct Memory {
-  std::list<Cell> conses {};
-  std::list<std::string> symbol_storage {};
-  std::unordered_map<std::string, const std::string*>
-  symbol_lookup {};
-  std::list<ClosureData> closures {};
+  static constexpr std::size_t block_size = 1 << 20;
+  std::mutex mutex {};
+  Heap heap {};
+  SymbolTable symbols {heap};
+  std::list<VectorData> vectors {};
+  std::list<TableData> tables {};
+  std::list<ThreadData> threads {};
+  std::list<PortData> ports {};
 
+  char* new_block(std::size_t size);
+  void* allocate(std::size_t size);
+  // makes this thread start a new block, after its block was mapped
+  // over by an image
+  void drop_allocation_buffer();
   Cons cons(Object car, Object cdr);
-  Symbol symbol(const std::string& s);
+  // builds the list of elements ending in tail, as one compact segment
+  // if compact_lists is set and as conses otherwise
+  bool compact_lists {false};
+  Object list(const Object* elements, std::size_t n, Object tail);
+  Object list(const std::vector<Object>& elements);
+  Symbol symbol(std::string_view s);
+  // a short string if s fits, otherwise a copy on the heap
+  Object string(std::string_view s);
+  // a heap string of the given length to be filled in by the caller
+  String string_buffer(std::size_t length);
   Closure closure(void* code,
 		  Object* fvs, std::int32_t n_fvs,
 		  std::int32_t n_params);
+  Vector vector(std::vector<double>&& elements);
+  Table table();
+  Thread thread(Object f);
+  // waits for every thread spawned so far and the ones they spawn
+  // meanwhile, whether or not the program joined them
+  void join_threads();
+  // closes file when the port is closed if owned is set
+  Port port(std::FILE* file, bool owned);
+  // the port of standard input, made on first use; -server starts a
+  // new one for every job, as each job has its own standard input
+  Port standard_input_port {nullptr};
+  Port standard_input();
+  void reset_standard_input();
 };
 
 extern Memory memory;
 
+// Work-stealing thread pool. Every worker has its own deque of tasks; it
+// pops from the back of its own deque and, when that is empty, steals
+// from the front of the others'. run executes tasks itself until none
+// are left to take and then sleeps until the batch is done, so it can
+// be called from inside a task.
+class ThreadPool {
+private:
+  struct Worker {
+    std::mutex mutex {};
+    std::deque<std::function<void()>> tasks {};
+  };
+  std::vector<std::unique_ptr<Worker>> workers {};
+  std::vector<std::thread> threads {};
+  std::atomic<std::size_t> queued {0};
+  std::atomic<std::size_t> next_worker {0};
+  std::mutex sleep_mutex {};
+  std::condition_variable wake {};
+  bool stopping {false};
+  bool pop(std::size_t i, std::function<void()>& task);
+  bool steal(std::size_t i, std::function<void()>& task);
+  void work(std::size_t i);
+public:
+  ThreadPool(std::size_t n_workers);
+  ~ThreadPool();
+  std::size_t size() const { return workers.size(); }
+  void run(std::vector<std::function<void()>>&& tasks);
+  static ThreadPool& instance();
+};
+
+// Output path of the print builtin. Objects are formatted into a large
+// buffer that is written out when it fills up, at exit, and after
+// every print if stdout is a terminal.
+class Printer {
+private:
+  static constexpr std::size_t buffer_size = 64 * 1024;
+  std::unique_ptr<char[]> buffer {new char[buffer_size]};
+  std::size_t used {0};
+  bool line_buffered;
+  std::mutex mutex {};
+  struct Frame {
+    enum { value, rest, close } kind;
+    Object o;
+  };
+  std::vector<Frame> stack {};
+  void write(std::string_view s);
+  void write(double d);
+  void write(std::int64_t i);
+  void write_out();
+public:
+  Printer();
+  ~Printer();
+  void print(Object o);
+  void flush();
+  // after stdout was pointed at another file
+  void check_terminal();
+};
+
+extern Printer printer;
+
 namespace Constants {
   extern const Object nil; 
   extern const Object if_; 
@@ -92,36 +395,100 @@ namespace Constants {
   extern const Object cons;
   extern const Object t;
   extern const Object lambda;
+  extern const Object define;
 }
 
 extern "C" { 
-  void _add(Object* out, Object* o1, Object* o2);
-  void _sub(Object* out, Object* o1, Object* o2);
-  void _mult(Object* out, Object* o1, Object* o2);
-  void __div(Object* out, Object* o1, Object* o2);
-  void _cons(Object* out, Object* o1, Object* o2);
-  void _make_number(Object* out, double d);
-  void _make_symbol(Object* out, const char* data);
-  bool _is_nil(Object* o1);
-  void _print(Object* out, Object* o1);
-  void _equal(Object* out, Object* o1, Object *o2);
-  void* _get_code(Object* o1, int n);
-  Object* _get_fvs(Object* o1);
+  Object _add(Object o1, Object o2);
+  Object _sub(Object o1, Object o2);
+  Object _mult(Object o1, Object o2);
+  Object __div(Object o1, Object o2);
+  Object _cons(Object o1, Object o2);
+  Object _car(Object o1);
+  Object _cdr(Object o1);
+  Object _make_number(double d);
+  Object _make_symbol(const char* data);
+  bool _is_nil(Object o1);
+  Object _print(Object o1);
+  Object _equal(Object o1, Object o2);
+  bool _is_equal(Object o1, Object o2);
+  Object _lt(Object o1, Object o2);
+  Object _gt(Object o1, Object o2);
+  Object _le(Object o1, Object o2);
+  Object _ge(Object o1, Object o2);
+  Object _num_eq(Object o1, Object o2);
+  Object _number_p(Object o1);
+  Object _symbol_p(Object o1);
+  Object _cons_p(Object o1);
+  Object _closure_p(Object o1);
+  Object _vector_p(Object o1);
+  Object _null_p(Object o1);
+  [[noreturn]] void _call_error(Object o1, std::int32_t n);
+  Object _create_closure(void* code,
+			 Object* fvs, std::int32_t n_fvs,
+			 std::int32_t n_params);
+  Object _make_vector(Object o1, Object o2);
+  Object _list_to_vector(Object o1);
+  Object _vector_length(Object o1);
+  Object _vector_ref(Object o1, Object o2);
+  Object _vector_map(Object o1, Object o2);
+  Object _vector_sum(Object o1);
+  Object _dot(Object o1, Object o2);
+  Object _make_table();
+  Object _table_get(Object o1, Object o2);
+  Object _table_put(Object o1, Object o2, Object o3);
+  Object _table_count(Object o1);
+  Object _table_p(Object o1);
+  Object _spawn(Object o1);
+  Object _join(Object o1);
+  Object _pmap(Object o1, Object o2);
+  Object _make_list(const Object* elements, std::int64_t n, Object tail);
+  Object _string_p(Object o1);
+  Object _string_length(Object o1);
+  Object _string_append(Object o1, Object o2);
+  Object _substring(Object o1, Object o2, Object o3);
+  Object _string_to_symbol(Object o1);
+  Object _symbol_to_string(Object o1);
+  Object _open_input_file(Object o1);
+  Object _standard_input();
+  Object _read_line(Object o1);
+  Object _read_datum(Object o1);
+  Object _read_lines(Object o1);
+  Object _read_data(Object o1);
+  Object _close_input(Object o1);
+  Object _port_p(Object o1);
 }
 
 enum class Token {
-  lparen, rparen, dot, number, symbol, eof,
-  quote
+  lparen, rparen, dot, number, fixnum, symbol, eof,
+  quote, string
+};
+
+struct SourcePosition {
+  int line {0};
+  int column {0};
 };
 
+// keyed by the address of a list's first car, which is where the
+// list is stored both for conses and compact lists
+using SourceMap = std::unordered_map<const Object*, SourcePosition>;
+
 class Tokenizer {
 private:
   std::istream& is;
   Token last_token {};
   bool did_peek {false};
+  SourcePosition curr_position {1, 0};
+  SourcePosition last_position {};
+  int get();
+  void unget();
 public:
   double number_data {};
+  std::int64_t fixnum_data {};
+  // the name of a symbol, or the characters of a string literal
   std::string symbol_data {};
+  // position of the first character of the last token read
+  SourcePosition token_position {};
   
   Tokenizer(std::istream& is); 
   Token peek();  
@@ -132,13 +499,55 @@ class Reader {
 private:
   Tokenizer t;
 public:
+  // where each list that was read started in the input
+  SourceMap positions {};
   Reader(std::istream& is);
   Object read();
+  // whether only whitespace is left in the input
+  bool at_end();
+};
+
+// An input port over a file or standard input. The file is read one
+// line at a time with getdelim through its stdio buffer, which is
+// large (buffer_size) for files the port opens and for standard input
+// when it isn't a terminal. The line is the streambuf's get area:
+// read-line takes it as it is and read-datum's Reader reads from it, so
+// the port only holds on to the longest line, however long the input.
+struct PortData : std::streambuf {
+  static constexpr std::size_t buffer_size = 1 << 20;
+  PortData(std::FILE* file, bool owned);
+  ~PortData();
+  // the next line without its newline or the next datum, or nil at the
+  // end of the input
+  Object read(Record record);
+  // the list of the records left in the input, of which only the
+  // first has been read yet
+  Object read_list(Record record);
+  // reads the next element of a lazy list into the cdr of its last
+  // cell, which is a tag_stream naming the port, unless another thread
+  // has already
+  static void read_rest(Cell& cell);
+  // the rest of the input is empty afterwards, and the line is freed
+  void close();
+protected:
+  int_type underflow() override;
+private:
+  std::FILE* file;
+  bool owned;
+  char* line {nullptr};
+  std::size_t capacity {0};
+  std::mutex mutex {};
+  std::istream stream {this};
+  Reader reader {stream};
+  // like read, but empty at the end of the input, which tells it
+  // apart from a datum that is nil
+  std::optional<Object> next(Record record);
 };
 
 class FormVisitor;
 class Form {
 public:
+  SourcePosition position {};
   virtual void accept(FormVisitor& visitor) = 0;
   virtual ~Form() {}
 };
@@ -167,8 +576,9 @@ public:
 
 class NumberForm : public Form {
 public:
-  double number;
-  NumberForm(double number) : number{number} {}
+  // a double or a fixnum
+  Object number;
+  NumberForm(Object number) : number{number} {}
   void accept(FormVisitor& visitor) override {
     visitor(*this);
   }
@@ -228,6 +638,7 @@ struct FunctionBinding {
   Symbol binder;
   std::vector<Symbol> parameters;
   std::unique_ptr<Form> definition;
+  SourcePosition position {};
   FunctionBinding(Symbol binder,
 		  std::vector<Symbol>&& parameters,
 		  std::unique_ptr<Form>&& definition)
@@ -289,11 +700,140 @@ public:
 };
 
 struct Parser {
-  static std::unique_ptr<Form> parse(const Object& o);
-  static std::unique_ptr<Form> parse_if(const Object& o);
-  static std::unique_ptr<Form> parse_let(const Object& o);
-  static std::unique_ptr<Form> parse_letrec(const Object& o);
-  static std::unique_ptr<Form> parse_quote(const Object& o);
-  static std::unique_ptr<Form> parse_application(const Object& o);
-  static std::unique_ptr<Form> parse_lambda(const Object& o);
+  const SourceMap& positions;
+  Parser(const SourceMap& positions) : positions{positions} {}
+  std::unique_ptr<Form> parse(const Object& o);
+  std::unique_ptr<Form> parse_form(const Object& o);
+  std::unique_ptr<Form> parse_if(const Object& o);
+  std::unique_ptr<Form> parse_let(const Object& o);
+  std::unique_ptr<Form> parse_letrec(const Object& o);
+  std::unique_ptr<Form> parse_quote(const Object& o);
+  std::unique_ptr<Form> parse_application(const Object& o);
+  std::unique_ptr<Form> parse_lambda(const Object& o);
+};
+
+template <typename T>
+struct Discriminator : public FormVisitor {
+  T* ref {nullptr};
+
+  static T* as(Form& f) {
+    Discriminator<T> d;
+    f.accept(d);
+    return d.ref;
+  }
+
+  void operator()(NumberForm& f) override {
+    if constexpr (std::is_same<T, NumberForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(SymbolForm& f) override {
+    if constexpr (std::is_same<T, SymbolForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(IfForm& f) override {
+    if constexpr (std::is_same<T, IfForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(LetForm& f) override {
+    if constexpr (std::is_same<T, LetForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(LetrecForm& f) override {
+    if constexpr (std::is_same<T, LetrecForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(QuoteForm& f) override {
+    if constexpr (std::is_same<T, QuoteForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(ApplicationForm& f) override {
+    if constexpr (std::is_same<T, ApplicationForm>()) {
+      ref = &f;
+    }
+  }
+  void operator()(LambdaForm& f) override {
+    if constexpr (std::is_same<T, LambdaForm>()) {
+      ref = &f;
+    }
+  }
+};
+
+template <typename T>
+void remove(const T& t, std::unordered_set<T>& s) {
+  auto it = s.find(t);
+  if (it != s.end())
+      s.erase(it);
+}
+
+template <typename G>
+struct FreeVarCollector : public FormVisitor {
+  G global_lookup;
+  std::unordered_set<Symbol> res;
+  FreeVarCollector(G global_lookup)
+    : global_lookup{global_lookup}
+  {}
+
+  void collect(Form& f) {
+    f.accept(*this);
+  }
+  void operator()(NumberForm& f) override {
+    // no free variables
+  }
+  void operator()(SymbolForm& f) override {
+    if (!global_lookup(f.symbol))
+      res.insert(f.symbol);
+  }
+  void operator()(IfForm& f) override {
+    collect(*f.cond_form);
+    collect(*f.then_form);
+    collect(*f.else_form);
+  }
+  void operator()(LetForm& f) override {
+    // the semantics of let allow one to refer
+    // to variables in previous bindings, thus,
+    // (let ((binder definition) . rest) body)
+    // is essentially equivalent to
+    // ((lambda (binder) (let rest body)) definition)
+    collect(*f.body);
+    for (auto it = f.bindings.rbegin();
+	 it != f.bindings.rend();
+	 ++it) {
+      auto& binding = *it;
+      remove(binding.binder, res);
+      collect(*binding.definition);
+    }
+  }
+  void operator()(LetrecForm& f) override {
+    collect(*f.body);
+    for (auto&& binding : f.bindings) {
+      collect(*binding.definition);
+      for (auto&& parameter : binding.parameters) {
+	remove(parameter, res);
+      }
+    }
+    for (auto&& binding : f.bindings) {
+      remove(binding.binder, res);
+    }
+  }
+  void operator()(QuoteForm& f) override {
+    //no free variables
+  }
+  void operator()(ApplicationForm& f) override {
+    collect(*f.function_form);
+    for (auto&& arg : f.arg_forms) {
+      collect(*arg);
+    }
+  }
+  void operator()(LambdaForm& f) override {
+    collect(*f.body);
+    for (auto&& parameter : f.parameters) {
+      remove(parameter, res);
+    }
+  }
 };
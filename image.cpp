@@ -0,0 +1,285 @@
+#include <cstring>
+#include <cerrno>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include "image.hpp"
+
+namespace {
+  constexpr char magic[8] = "kaleimg";
+  constexpr std::uint64_t version = 1;
+
+  // The file starts with the header, followed by the heap at
+  // heap_offset, which mmap wants aligned to a page, followed by the
+  // rest of the image at rest_offset.
+  struct Header {
+    char magic[8];
+    std::uint64_t version;
+    std::uint64_t heap_address;
+    std::uint64_t heap_offset;
+    std::uint64_t heap_size;
+    std::uint64_t rest_offset;
+  };
+
+  // the symbols interned by static initialization, which a process
+  // loading the image has already allocated, so they must be where the
+  // image has them
+  const Object* constants[] {
+    &Constants::nil, &Constants::if_, &Constants::let, &Constants::letrec,
+    &Constants::quote, &Constants::cons, &Constants::lambda,
+    &Constants::define, &Constants::t,
+  };
+
+  void write_u64(std::ostream& os, std::uint64_t n) {
+    os.write(reinterpret_cast<const char*>(&n), sizeof(n));
+  }
+
+  void write_string(std::ostream& os, std::string_view s) {
+    write_u64(os, s.size());
+    os.write(s.data(), s.size());
+  }
+
+  template <typename T>
+  void write_pointer(std::ostream& os, T* p) {
+    write_u64(os, reinterpret_cast<std::uintptr_t>(p));
+  }
+
+  std::uint64_t read_u64(std::istream& is) {
+    std::uint64_t n;
+    if (!is.read(reinterpret_cast<char*>(&n), sizeof(n))) {
+      throw std::runtime_error("truncated image");
+    }
+    return n;
+  }
+
+  std::string read_string(std::istream& is) {
+    std::string s(read_u64(is), '\0');
+    if (!is.read(s.data(), s.size())) {
+      throw std::runtime_error("truncated image");
+    }
+    return s;
+  }
+
+  template <typename T>
+  T* read_pointer(std::istream& is) {
+    return reinterpret_cast<T*>(static_cast<std::uintptr_t>(read_u64(is)));
+  }
+}
+
+// Finds the closures reachable from the definitions. Long strings and
+// the closures of letrec functions that are compiled into the code
+// rather than allocated on the heap are copied onto it, as only the
+// heap is saved.
+void Image::collect(const std::function<std::optional<CodeAddress>(void*)>& code_address) {
+  auto heap_begin = memory.heap.begin();
+  auto in_heap = [&](const void* p) {
+    return p >= heap_begin && p < memory.heap.used_end();
+  };
+  closures.clear();
+  std::unordered_set<const void*> seen;
+  // one copy of each static closure, so that it stays eq to itself
+  std::unordered_map<Closure, Closure> copies;
+  // the places holding the objects still to look at, which are
+  // updated in place
+  std::vector<Object*> stack;
+  for (auto&& [symbol, value] : definitions) {
+    stack.push_back(&value);
+  }
+  while (!stack.empty()) {
+    auto o = stack.back();
+    stack.pop_back();
+    switch (o->kind()) {
+    case Object::tag_string: {
+      auto s = reinterpret_cast<String>(o->data);
+      if (!in_heap(s)) {
+	*o = memory.string(s->view());
+      }
+      break;
+    }
+    case Object::tag_cons: {
+      auto cell = o->as_cons();
+      if (!seen.insert(cell).second) break;
+      stack.push_back(&cell->car);
+      stack.push_back(&cell->cdr);
+      break;
+    }
+    case Object::tag_compact: {
+      // the rest of a segment, followed by its tail
+      auto elements = reinterpret_cast<Object*>(o->data);
+      auto length = o->tag >> 8;
+      std::uint64_t i = 0;
+      for (; i <= length && seen.insert(elements + i).second; ++i) {
+	stack.push_back(elements + i);
+      }
+      break;
+    }
+    case Object::tag_closure: {
+      auto closure = o->as_closure();
+      if (!in_heap(closure)) {
+	auto&& copy = copies[closure];
+	if (!copy) {
+	  copy = memory.closure(closure->code, closure->fvs(), closure->n_fvs,
+				closure->n_params);
+	}
+	*o = Object{copy};
+	closure = copy;
+      }
+      if (!seen.insert(closure).second) break;
+      auto address = code_address(closure->code);
+      if (!address) {
+	throw std::runtime_error("can't save a closure of code that isn't in the image");
+      }
+      closures.emplace_back(closure, std::move(*address));
+      for (std::int32_t i = 0; i < closure->n_fvs; ++i) {
+	stack.push_back(closure->fvs() + i);
+      }
+      break;
+    }
+    case Object::tag_vector:
+      throw std::runtime_error("can't save a vector in an image");
+    case Object::tag_table:
+      throw std::runtime_error("can't save a table in an image");
+    case Object::tag_thread:
+      throw std::runtime_error("can't save a thread in an image");
+    case Object::tag_port:
+    case Object::tag_stream:
+      throw std::runtime_error("can't save a port in an image");
+    default:
+      // numbers, symbols and short strings
+      break;
+    }
+  }
+}
+
+void Image::save(const std::string& path,
+		 const std::function<std::optional<CodeAddress>(void*)>& code_address) {
+  if (!memory.heap.fixed()) {
+    throw std::runtime_error("the heap isn't at its fixed address");
+  }
+  collect(code_address);
+
+  std::ofstream os {path, std::ios::binary};
+  if (!os) throw std::runtime_error("can't write image " + path);
+  auto page_size = static_cast<std::uint64_t>(sysconf(_SC_PAGESIZE));
+  auto heap_begin = memory.heap.begin();
+  Header header {};
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.version = version;
+  header.heap_address = reinterpret_cast<std::uintptr_t>(heap_begin);
+  header.heap_offset = page_size;
+  header.heap_size = memory.heap.used_end() - heap_begin;
+  header.rest_offset = header.heap_offset + header.heap_size;
+  os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  os.seekp(header.heap_offset);
+  os.write(heap_begin, header.heap_size);
+
+  for (auto c : constants) {
+    write_pointer(os, c->as_symbol());
+  }
+  auto&& symbols = memory.symbols;
+  write_u64(os, symbols.count);
+  write_pointer(os, symbols.block_next);
+  write_pointer(os, symbols.block_end);
+  write_u64(os, symbols.slots.size());
+  for (auto s : symbols.slots) {
+    write_pointer(os, s);
+  }
+  write_u64(os, definitions.size());
+  for (auto&& [symbol, value] : definitions) {
+    write_pointer(os, symbol);
+    write_u64(os, value.tag);
+    write_u64(os, value.data);
+  }
+  write_u64(os, closures.size());
+  for (auto&& [closure, address] : closures) {
+    write_pointer(os, closure);
+    write_string(os, address.module);
+    write_string(os, address.function);
+  }
+  write_u64(os, objects.size());
+  for (auto&& object : objects) {
+    write_string(os, object.module);
+    write_string(os, object.bytes);
+  }
+  write_u64(os, next_module);
+  if (!os.flush()) throw std::runtime_error("can't write image " + path);
+}
+
+void Image::load(const std::string& path) {
+  std::ifstream is {path, std::ios::binary};
+  if (!is) throw std::runtime_error("can't read image " + path);
+  Header header;
+  if (!is.read(reinterpret_cast<char*>(&header), sizeof(header))
+      || std::memcmp(header.magic, magic, sizeof(magic)) != 0
+      || header.version != version) {
+    throw std::runtime_error(path + " isn't a kale image");
+  }
+  if (header.heap_address
+      != reinterpret_cast<std::uintptr_t>(memory.heap.begin())) {
+    throw std::runtime_error("the image's heap is at another address");
+  }
+  is.seekg(header.rest_offset);
+  for (auto c : constants) {
+    if (read_pointer<const SymbolData>(is) != c->as_symbol()) {
+      throw std::runtime_error("the image was written by another kale");
+    }
+  }
+  auto count = read_u64(is);
+  auto block_next = read_pointer<char>(is);
+  auto block_end = read_pointer<char>(is);
+  std::vector<Symbol> slots(read_u64(is));
+  for (auto&& s : slots) {
+    s = read_pointer<const SymbolData>(is);
+  }
+  definitions.clear();
+  for (auto n = read_u64(is); n > 0; --n) {
+    auto symbol = read_pointer<const SymbolData>(is);
+    Object value {Constants::nil};
+    value.tag = read_u64(is);
+    value.data = read_u64(is);
+    definitions.emplace_back(symbol, value);
+  }
+  closures.clear();
+  for (auto n = read_u64(is); n > 0; --n) {
+    auto closure = read_pointer<ClosureData>(is);
+    auto module = read_string(is);
+    auto function = read_string(is);
+    closures.push_back({closure, {std::move(module), std::move(function)}});
+  }
+  objects.resize(read_u64(is));
+  for (auto&& object : objects) {
+    object.module = read_string(is);
+    object.bytes = read_string(is);
+  }
+  next_module = read_u64(is);
+
+  auto fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("can't read image " + path + ": " + std::strerror(errno));
+  }
+  // the mapping keeps the file open
+  try {
+    memory.heap.map(fd, header.heap_offset, header.heap_size);
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+  close(fd);
+  // the current block was mapped over
+  memory.drop_allocation_buffer();
+  auto&& symbols = memory.symbols;
+  symbols.slots = std::move(slots);
+  symbols.count = count;
+  symbols.block_next = block_next;
+  symbols.block_end = block_end;
+}
+
+void Image::relocate(const std::function<void*(const CodeAddress&)>& address) {
+  for (auto&& [closure, code] : closures) {
+    auto p = address(code);
+    if (!p) {
+      throw std::runtime_error("can't find " + code.function + " of " + code.module);
+    }
+    closure->code = p;
+  }
+}
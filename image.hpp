@@ -0,0 +1,49 @@
+#pragma once
+#include "decls.hpp"
+#include <optional>
+
+// A saved heap, with the top-level definitions that refer into it and
+// the code compiled for them, in the spirit of the dumped images of
+// other Lisps: -save-image writes one after running a program's
+// top-level forms, and -load-image starts from it without reading or
+// running them again.
+//
+// The heap's used part is written as it is and mapped back in at the
+// same address (see Heap), so the pointers in it stay valid. The
+// exception are closures' pointers to their code, which is linked anew
+// at other addresses: they are saved as the object file and function
+// they point to, and fixed up by relocate once the objects are linked.
+// Vectors, tables, threads and ports own memory outside the heap and
+// can't be saved.
+class Image {
+public:
+  // the object code the JIT linked for a module, by the module's name
+  struct ObjectFile {
+    std::string module;
+    std::string bytes;
+  };
+  struct CodeAddress {
+    std::string module;
+    std::string function;
+  };
+  std::vector<ObjectFile> objects {};
+  std::vector<std::pair<Symbol, Object>> definitions {};
+  // the number of the next REPL module, so that a session started from
+  // the image doesn't reuse the names of the image's modules
+  std::uint64_t next_module {0};
+
+  // code_address says where the code a closure points to is, if it is
+  // in one of the objects
+  void save(const std::string& path,
+	    const std::function<std::optional<CodeAddress>(void*)>& code_address);
+  // maps the image's heap over the current one, so it must come before
+  // anything other than static objects is allocated
+  void load(const std::string& path);
+  // points the closures to their code, given where the objects'
+  // functions were linked to
+  void relocate(const std::function<void*(const CodeAddress&)>& address);
+
+private:
+  std::vector<std::pair<Closure, CodeAddress>> closures {};
+  void collect(const std::function<std::optional<CodeAddress>(void*)>& code_address);
+};
@@ -0,0 +1,62 @@
+// Runs a program on a kale started with -server: kale-client socket <
+// program behaves like kale < program, with the program's output and
+// errors on kale-client's, but without setting up a JIT first. The
+// client hands the server its standard input, output and error along
+// with one byte, and exits with the status byte the server answers
+// with (see server.hpp).
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+  if (argc != 2) {
+    std::cerr << "usage: kale-client socket < program\n";
+    return 1;
+  }
+  sockaddr_un address {};
+  address.sun_family = AF_UNIX;
+  if (std::strlen(argv[1]) >= sizeof(address.sun_path)) {
+    std::cerr << "kale-client: socket path too long: " << argv[1] << "\n";
+    return 1;
+  }
+  std::strcpy(address.sun_path, argv[1]);
+  auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0
+      || connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0) {
+    std::cerr << "kale-client: can't connect to " << argv[1] << ": "
+	      << std::strerror(errno) << "\n";
+    return 1;
+  }
+
+  int fds[3] {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char byte = 0;
+  iovec iov {&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] {};
+  msghdr message {};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  auto header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(sizeof(fds));
+  std::memcpy(CMSG_DATA(header), fds, sizeof(fds));
+  if (sendmsg(fd, &message, 0) != 1) {
+    std::cerr << "kale-client: can't send the job: " << std::strerror(errno) << "\n";
+    return 1;
+  }
+
+  // the server answers once the job has run
+  char status;
+  ssize_t n;
+  while ((n = read(fd, &status, 1)) < 0 && errno == EINTR) {}
+  if (n != 1) {
+    std::cerr << "kale-client: the server went away\n";
+    return 1;
+  }
+  return static_cast<unsigned char>(status);
+}
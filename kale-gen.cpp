@@ -0,0 +1,101 @@
+// Generates large Kale programs of a given shape and size, to see how
+// the compiler's phases scale with the size of their input (see
+// scale.sh). Usage: kale-gen shape n
+//
+// Every program's body is in a letrec function that gets its argument
+// k at run time, so that the partial evaluator can't fold the program
+// away before it reaches the compiler.
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+
+using Generator = std::function<void(std::ostream&, int)>;
+
+// n letrec bindings, each calling the one before it; k is free in
+// them, so it gets injected into every call
+static void letrec_bindings(std::ostream& os, int n) {
+  os << "(letrec (";
+  for (int i = 0; i < n; ++i) {
+    os << "\n  (f" << i << " (x) ";
+    if (i == 0) {
+      os << "(add x k))";
+    } else {
+      os << "(add (f" << i-1 << " x) k))";
+    }
+  }
+  os << ")\n  (f" << n-1 << " 0))";
+}
+
+// n lambdas nested in each other, the innermost referring to the
+// outermost's parameter, so that each one closes over it
+static void nested_lambdas(std::ostream& os, int n) {
+  os << "(let ((f ";
+  for (int i = 0; i < n; ++i) {
+    os << "(lambda (x" << i << ")\n";
+  }
+  os << "(add x0 (add x" << n-1 << " k))";
+  os << std::string(n, ')') << "))\n  ";
+  os << std::string(n, '(') << "f";
+  for (int i = 0; i < n; ++i) {
+    os << " " << i << ")";
+  }
+  os << ")";
+}
+
+// n lets nested in each other, each referring to k, which is looked
+// up through all of their scopes
+static void nested_lets(std::ostream& os, int n) {
+  os << "(let ((x0 k))\n";
+  for (int i = 1; i < n; ++i) {
+    os << "(let ((x" << i << " (add x" << i-1 << " k)))\n";
+  }
+  os << "x" << n-1 << std::string(n, ')');
+}
+
+// one let with n bindings, each referring to the one before it
+static void wide_let(std::ostream& os, int n) {
+  os << "(let ((v0 k)";
+  for (int i = 1; i < n; ++i) {
+    os << "\n  (v" << i << " (add v" << i-1 << " k))";
+  }
+  os << ")\n  v" << n-1 << ")";
+}
+
+// a quoted list of n elements, in sublists of ten symbols and numbers
+static void quoted_list(std::ostream& os, int n) {
+  os << "(cons k '(";
+  for (int i = 0; i < n; i += 10) {
+    os << "\n  (";
+    for (int j = i; j < n && j < i + 10; ++j) {
+      os << (j % 2 ? " " + std::to_string(j) : " s" + std::to_string(j));
+    }
+    os << ")";
+  }
+  os << "))";
+}
+
+static const std::map<std::string, Generator> generators {
+  {"letrec", letrec_bindings},
+  {"lambda", nested_lambdas},
+  {"let", nested_lets},
+  {"wide", wide_let},
+  {"quote", quoted_list},
+};
+
+int main(int argc, char** argv) {
+  auto it = argc == 3 ? generators.find(argv[1]) : generators.end();
+  auto n = argc == 3 ? std::atoi(argv[2]) : 0;
+  if (it == generators.end() || n < 1) {
+    std::cerr << "usage: kale-gen shape n, where shape is one of";
+    for (auto&& [name, generator] : generators) {
+      std::cerr << " " << name;
+    }
+    std::cerr << "\n";
+    return 1;
+  }
+  std::cout << "(letrec ((run (k)\n";
+  it->second(std::cout, n);
+  std::cout << "))\n  (print (run 1)))\n";
+}
@@ -1,27 +1,469 @@
 #include "compiler.hpp"
+#include "peval.hpp"
+#include "image.hpp"
+#include "server.hpp"
 #include "llvm/ExecutionEngine/Orc/Core.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#include "llvm/ExecutionEngine/Orc/ObjectTransformLayer.h"
 #include "llvm/ExecutionEngine/Orc/LLJIT.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/DebugObjectManagerPlugin.h"
+#include "llvm/ExecutionEngine/Orc/EPCDebugObjectRegistrar.h"
+#include "llvm/ExecutionEngine/Orc/EPCEHFrameRegistrar.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/JITLoaderGDB.h"
+#include "llvm/ExecutionEngine/Orc/TargetProcess/RegisterEHFrames.h"
+#include "llvm/ExecutionEngine/JITLink/JITLink.h"
+#include "llvm/ADT/ScopeExit.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/Support/Host.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/Process.h"
+#include <mutex>
+#include <map>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
 
 using namespace llvm::orc;
 
+// the gdb and eh-frame registrars look these up in the process, make
+// sure they get linked in
+static auto register_jit_loader_gdb [[maybe_unused]] =
+  &llvm_orc_registerJITLoaderGDBWrapper;
+static auto register_eh_frame [[maybe_unused]] =
+  &llvm_orc_registerEHFrameSectionWrapper;
+
+// Writes the address and size of every JIT'd function to
+// /tmp/perf-<pid>.map, which is where perf looks for symbols of
+// code it can't find in any mapped file.
+class PerfMapPlugin : public ObjectLinkingLayer::Plugin {
+private:
+  std::mutex mutex;
+  std::unique_ptr<raw_fd_ostream> os;
+public:
+  PerfMapPlugin() {
+    std::error_code ec;
+    auto path = "/tmp/perf-" + std::to_string(sys::Process::getProcessId()) + ".map";
+    os = std::make_unique<raw_fd_ostream>(path, ec);
+    if (ec) {
+      errs() << "couldn't open " << path << ": " << ec.message() << "\n";
+      os.reset();
+    }
+  }
+
+  void modifyPassConfig(MaterializationResponsibility& mr,
+			jitlink::LinkGraph& g,
+			jitlink::PassConfiguration& config) override {
+    if (!os) return;
+    config.PostFixupPasses.push_back([this](jitlink::LinkGraph& g) {
+      std::lock_guard<std::mutex> lock{mutex};
+      for (auto&& sym : g.defined_symbols()) {
+	if (!sym->hasName() || !sym->isCallable()) continue;
+	*os << format_hex_no_prefix(sym->getAddress().getValue(), 1) << " "
+	    << format_hex_no_prefix(sym->getSize(), 1) << " "
+	    << sym->getName() << "\n";
+      }
+      os->flush();
+      return Error::success();
+    });
+  }
+
+  Error notifyFailed(MaterializationResponsibility& mr) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(ResourceKey k) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(ResourceKey dst, ResourceKey src) override {}
+};
+
+// Where the functions of each linked module went, for saving and
+// loading images, which refer to closures' code by module and
+// function. Modules are told apart by the name of their object buffer,
+// which is the module's name plus object_suffix.
+class CodeMapPlugin : public ObjectLinkingLayer::Plugin {
+private:
+  std::mutex mutex;
+  std::unordered_map<void*, Image::CodeAddress> addresses;
+  std::map<std::pair<std::string, std::string>, void*> functions;
+public:
+  static constexpr std::string_view object_suffix = "-jitted-objectbuffer";
+  static std::string module_name(StringRef object_name) {
+    object_name.consume_back(object_suffix);
+    return object_name.str();
+  }
+
+  void modifyPassConfig(MaterializationResponsibility& mr,
+			jitlink::LinkGraph& g,
+			jitlink::PassConfiguration& config) override {
+    config.PostFixupPasses.push_back([this](jitlink::LinkGraph& g) {
+      std::lock_guard<std::mutex> lock{mutex};
+      auto module = module_name(g.getName());
+      for (auto&& sym : g.defined_symbols()) {
+	if (!sym->hasName() || !sym->isCallable()) continue;
+	auto address = reinterpret_cast<void*>(sym->getAddress().getValue());
+	auto name = sym->getName().str();
+	addresses[address] = {module, name};
+	functions[{module, name}] = address;
+      }
+      return Error::success();
+    });
+  }
+
+  std::optional<Image::CodeAddress> code_address(void* address) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = addresses.find(address);
+    if (it == addresses.end()) return std::nullopt;
+    return it->second;
+  }
+  void* function(const Image::CodeAddress& address) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = functions.find({address.module, address.function});
+    return it == functions.end() ? nullptr : it->second;
+  }
+
+  Error notifyFailed(MaterializationResponsibility& mr) override {
+    return Error::success();
+  }
+  Error notifyRemovingResources(ResourceKey k) override {
+    return Error::success();
+  }
+  void notifyTransferringResources(ResourceKey dst, ResourceKey src) override {}
+};
+
+// The symbols generated code can refer to: the runtime's entry points,
+// plus the libc functions LLVM may emit calls to. They are registered
+// with the JIT directly rather than searched for in the process.
+static SymbolMap runtime_symbols(MangleAndInterner& mangle) {
+  SymbolMap symbols;
+  auto&& add = [&](const char* name, auto* address) {
+    symbols[mangle(name)] = JITEvaluatedSymbol::fromPointer(address);
+  };
+  add("_add", &_add);
+  add("_sub", &_sub);
+  add("_mult", &_mult);
+  add("__div", &__div);
+  add("_cons", &_cons);
+  add("_car", &_car);
+  add("_cdr", &_cdr);
+  add("_make_number", &_make_number);
+  add("_make_symbol", &_make_symbol);
+  add("_is_nil", &_is_nil);
+  add("_print", &_print);
+  add("_equal", &_equal);
+  add("_is_equal", &_is_equal);
+  add("_lt", &_lt);
+  add("_gt", &_gt);
+  add("_le", &_le);
+  add("_ge", &_ge);
+  add("_num_eq", &_num_eq);
+  add("_number_p", &_number_p);
+  add("_symbol_p", &_symbol_p);
+  add("_cons_p", &_cons_p);
+  add("_closure_p", &_closure_p);
+  add("_vector_p", &_vector_p);
+  add("_table_p", &_table_p);
+  add("_null_p", &_null_p);
+  add("_call_error", &_call_error);
+  add("_create_closure", &_create_closure);
+  add("_make_vector", &_make_vector);
+  add("_list_to_vector", &_list_to_vector);
+  add("_vector_length", &_vector_length);
+  add("_vector_ref", &_vector_ref);
+  add("_vector_map", &_vector_map);
+  add("_vector_sum", &_vector_sum);
+  add("_dot", &_dot);
+  add("_make_table", &_make_table);
+  add("_table_get", &_table_get);
+  add("_table_put", &_table_put);
+  add("_table_count", &_table_count);
+  add("_spawn", &_spawn);
+  add("_join", &_join);
+  add("_pmap", &_pmap);
+  add("_make_list", &_make_list);
+  add("_string_p", &_string_p);
+  add("_string_length", &_string_length);
+  add("_string_append", &_string_append);
+  add("_substring", &_substring);
+  add("_string_to_symbol", &_string_to_symbol);
+  add("_symbol_to_string", &_symbol_to_string);
+  add("_open_input_file", &_open_input_file);
+  add("_standard_input", &_standard_input);
+  add("_read_line", &_read_line);
+  add("_read_datum", &_read_datum);
+  add("_read_lines", &_read_lines);
+  add("_read_data", &_read_data);
+  add("_close_input", &_close_input);
+  add("_port_p", &_port_p);
+  add("_profile_call", &_profile_call);
+  add("memcpy", &memcpy);
+  add("memmove", &memmove);
+  add("memset", &memset);
+  return symbols;
+}
+
+// Wall-clock time of each startup phase, reported with -time
+class PhaseTimer {
+private:
+  using Clock = std::chrono::steady_clock;
+  bool enabled;
+  Clock::time_point start {Clock::now()};
+  Clock::time_point last {start};
+public:
+  PhaseTimer(bool enabled) : enabled{enabled} {}
+  void phase(const char* name) {
+    if (!enabled) return;
+    auto now = Clock::now();
+    errs() << format("%-10s %8.3f ms\n", name,
+		     std::chrono::duration<double, std::milli>(now - last).count());
+    last = now;
+  }
+  // a part of the phase still running that was measured on its own,
+  // which is left out of that phase
+  void part(const char* name, Clock::duration duration) {
+    if (!enabled) return;
+    errs() << format("%-10s %8.3f ms\n", name,
+		     std::chrono::duration<double, std::milli>(duration).count());
+    last += duration;
+  }
+  // time from entering main up to now, against what we aim for
+  void total(const char* name, double budget_ms) {
+    if (!enabled) return;
+    auto ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    errs() << format("%-10s %8.3f ms (budget %.0f ms)%s\n", name, ms, budget_ms,
+		     ms > budget_ms ? ", over budget" : "");
+  }
+};
+
+// from entering main to running the first instruction of a short
+// script
+constexpr double startup_budget_ms = 20;
+
+// Compiles a top-level form, which is either an expression or a
+// (define name expression). Returns whether it was a definition.
+static bool compile_toplevel(Compiler& compiler, Parser& parser,
+			     PhaseTimer& timer, const Object& o) {
+  auto&& simplify = [&](const Object& o) {
+    auto form = parser.parse(o);
+    timer.phase("parse");
+    Specializer{}.specialize(*form);
+    PartialEvaluator peval {[&](Symbol s) { return compiler.is_primitive(s); }};
+    auto simplified = peval.evaluate(std::move(form));
+    timer.phase("simplify");
+    return simplified;
+  };
+  // what is left of compiling after the free variables is building
+  // the IR
+  auto&& compiled = [&]() {
+    timer.part("free vars", compiler.free_var_time);
+    timer.part("inject", compiler.inject_time);
+    timer.phase("ir");
+  };
+  if (o.is_cons() && o.car() == Constants::define) {
+    auto rest = o.cdr();
+    if (!rest.is_cons() || !rest.car().is_symbol()
+	|| !rest.cdr().is_cons() || !rest.cdr().cdr().is_nil()) {
+      throw std::runtime_error("invalid define");
+    }
+    compiler.define(rest.car().as_symbol(), *simplify(rest.cdr().car()));
+    compiled();
+    return true;
+  }
+  compiler.compile(*simplify(o));
+  compiled();
+  return false;
+}
+
+// Reads the program on standard input, compiles it into a module of
+// its own in jd and runs it. The module's IR goes to standard output
+// ahead of what the program prints. after_link runs once the module is
+// linked. Returns the exit status.
+static int run_program(LLJIT& jit, JITDylib& jd, Compiler& compiler,
+		       PhaseTimer& timer,
+		       const std::function<void()>& after_link) {
+  try {
+    Reader reader {std::cin};
+    Parser parser {reader.positions};
+    auto o = reader.read();
+    // the program's input starts on the line after it
+    while (std::cin.peek() == ' ' || std::cin.peek() == '\t') std::cin.get();
+    if (std::cin.peek() == '\n') std::cin.get();
+    timer.phase("read");
+    compiler.begin_module("main");
+    compile_toplevel(compiler, parser, timer, o);
+    compiler.finish_module();
+    timer.phase("optimize");
+    compiler.module->print(outs(), nullptr);
+    // the program's output goes through the runtime's printer, make
+    // sure the code comes out first
+    outs().flush();
+    timer.phase("print ir");
+    if (auto err = jit.addIRModule(jd, compiler.take_module())) {
+      throw std::runtime_error(toString(std::move(err)));
+    }
+    auto main = jit.lookup(jd, "main");
+    if (!main) {
+      throw std::runtime_error(toString(main.takeError()));
+    }
+    after_link();
+    timer.phase("link");
+    timer.total("startup", startup_budget_ms);
+    main->toPtr<Object(*)()>()();
+  } catch (const std::exception& e) {
+    printer.flush();
+    errs() << "error: " << e.what() << "\n";
+    return 1;
+  }
+  return 0;
+}
+
+// -server: runs the programs of kale-client's jobs one at a time, each
+// in a JITDylib of its own that is removed once it has run, so that
+// what one job compiles is neither seen by the next nor kept linked.
+// What the jobs share is the JIT set up once, the runtime's symbols,
+// the heap and the thread pool. A job's phases are timed from when its
+// client connected. Returns only if accepting clients fails.
+static int run_jobs(LLJIT& jit, Server& server, bool optimize, bool debug_info,
+		    bool time) {
+  auto&& es = jit.getExecutionSession();
+  for (std::uint64_t n = 0;; ++n) {
+    try {
+      server.accept();
+    } catch (const std::exception& e) {
+      errs() << "error: " << e.what() << "\n";
+      return 1;
+    }
+    PhaseTimer timer{time};
+    auto status = 1;
+    if (auto jd = es.createJITDylib("job." + std::to_string(n))) {
+      jd->addToLinkOrder(jit.getMainJITDylib());
+      Compiler compiler{optimize, debug_info};
+      status = run_program(jit, *jd, compiler, timer, []() {});
+      // the threads the job spawned run its code, which goes with
+      // the JITDylib
+      memory.join_threads();
+      printer.flush();
+      outs().flush();
+      if (auto err = es.removeJITDylib(*jd)) {
+	errs() << "error: " << toString(std::move(err)) << "\n";
+      }
+    } else {
+      errs() << "error: " << toString(jd.takeError()) << "\n";
+    }
+    server.finish(status);
+  }
+}
+
+// A job that crashes takes its process with it, so the jobs run in a
+// child process. When it dies, the server forks a new one from where
+// it was before the first job, with the JIT set up and nothing run
+// yet. The client of the job that crashed gets the signal's exit
+// status, as it would from kale (see Server).
+static int serve(LLJIT& jit, const char* path, bool optimize, bool debug_info,
+		 bool time) {
+  std::optional<Server> server;
+  try {
+    server.emplace(path);
+  } catch (const std::exception& e) {
+    errs() << "error: " << e.what() << "\n";
+    return 1;
+  }
+  for (;;) {
+    outs().flush();
+    std::fflush(nullptr);
+    auto pid = fork();
+    if (pid < 0) {
+      errs() << "error: can't start the jobs' process: " << std::strerror(errno) << "\n";
+      return 1;
+    }
+    if (pid == 0) {
+      // the jobs go when the server does, and the socket is the
+      // server's to remove
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      if (getppid() == 1) std::_Exit(1);
+      std::_Exit(run_jobs(jit, *server, optimize, debug_info, time));
+    }
+    int wait_status;
+    while (waitpid(pid, &wait_status, 0) < 0) {
+      if (errno != EINTR) return 1;
+    }
+    if (!WIFSIGNALED(wait_status)) {
+      return WEXITSTATUS(wait_status);
+    }
+    errs() << "error: a job was killed by signal " << WTERMSIG(wait_status)
+	   << ", restarting\n";
+  }
+}
+
 int main(int argc, char** argv) {
-  auto optimize = false;
   auto end = argv+argc;
-  const std::string opt_flag = "-O";
-  if (std::find(argv, end, opt_flag) != end) {
-    optimize = true;
+  auto&& has_flag = [&](const std::string& flag) {
+    return std::find(argv, end, flag) != end;
+  };
+  // the argument following a flag
+  auto&& flag_value = [&](const std::string& flag) -> const char* {
+    auto it = std::find(argv, end, flag);
+    return it != end && it + 1 != end ? *(it + 1) : nullptr;
+  };
+  // -O: optimize, -g: emit line info and register the code with gdb,
+  // -perf: write a perf map, -compact: build lists as cdr-coded
+  // segments, -repl: read-eval-print loop (the default when reading
+  // from a terminal)
+  auto optimize = has_flag("-O");
+  auto debug_info = has_flag("-g");
+  auto perf_map = has_flag("-perf");
+  memory.compact_lists = has_flag("-compact");
+  auto repl = has_flag("-repl") || isatty(STDIN_FILENO);
+  // the program and the input following it, which (standard-input)
+  // reads, come through the same large buffer
+  if (!isatty(STDIN_FILENO)) {
+    std::setvbuf(stdin, nullptr, _IOFBF, PortData::buffer_size);
+  }
+  // -time: report how long each phase before running the program took
+  PhaseTimer timer{has_flag("-time")};
+  // -profile-generate file: count branches, calls and function entries
+  // into file, -profile-use file: optimize with the counts from file
+  auto profile_generate = flag_value("-profile-generate");
+  auto profile_use = flag_value("-profile-use");
+  // -save-image file: run every top-level form, then save the heap,
+  // the definitions and their code into file; -load-image file: start
+  // from what an image saved
+  auto save_image = flag_value("-save-image");
+  auto load_image = flag_value("-load-image");
+  if ((save_image || load_image) && (profile_generate || profile_use)) {
+    errs() << "error: images can't be combined with profiles\n";
+    return 1;
+  }
+  if (save_image) repl = true;
+  // -server socket: run the programs kale-client sends to socket
+  auto server_path = flag_value("-server");
+  if (server_path && (save_image || load_image || profile_generate || profile_use)) {
+    errs() << "error: -server can't be combined with images or profiles\n";
+    return 1;
+  }
+  // the image's heap replaces the current one, so this comes before
+  // anything is allocated on it
+  Image image;
+  if (load_image) {
+    try {
+      image.load(load_image);
+    } catch (const std::exception& e) {
+      errs() << "error: " << e.what() << "\n";
+      return 1;
+    }
   }
 
   ExitOnError ExitOnErr;
   
+  CodeMapPlugin* code_map = nullptr;
   InitializeNativeTarget();
   InitializeNativeTargetAsmPrinter();
   InitializeNativeTargetAsmParser();
@@ -34,46 +476,176 @@ int main(int argc, char** argv) {
     (LLJITBuilder()
      .setExecutorProcessControl(std::move(epc))
      .setJITTargetMachineBuilder(std::move(jtmb))
-     .setObjectLinkingLayerCreator([](auto&& es, auto&& triple) {
-       return std::make_unique<ObjectLinkingLayer>(es);
+     .setObjectLinkingLayerCreator([&](auto&& es, auto&& triple) {
+       auto layer = std::make_unique<ObjectLinkingLayer>(es);
+       // register the code's .eh_frame so runtime errors can unwind
+       // through it
+       layer->addPlugin(std::make_unique<EHFrameRegistrationPlugin>
+			(es, ExitOnErr(EPCEHFrameRegistrar::Create(es))));
+       if (perf_map) {
+	 layer->addPlugin(std::make_unique<PerfMapPlugin>());
+       }
+       if (save_image || load_image) {
+	 auto plugin = std::make_unique<CodeMapPlugin>();
+	 code_map = plugin.get();
+	 layer->addPlugin(std::move(plugin));
+       }
+       if (debug_info) {
+	 auto registrar = ExitOnErr(createJITLoaderGDBRegistrar(es));
+	 layer->addPlugin(std::make_unique<DebugObjectManagerPlugin>
+			  (es, std::move(registrar)));
+       }
+       return layer;
      })
      .setCompileFunctionCreator([](auto&& jtmb) {
        return std::make_unique<ConcurrentIRCompiler>(jtmb);
      })
      .create());
   
-  Compiler compiler{optimize};
+  // a thread the program spawned and never joined runs JIT'd code, it
+  // has to be done before the JIT, and with it that code, goes away
+  auto join_threads = make_scope_exit([]() { memory.join_threads(); });
+  MangleAndInterner mangle {jit->getExecutionSession(), jit->getDataLayout()};
+  ExitOnErr(jit->getMainJITDylib().define(absoluteSymbols(runtime_symbols(mangle))));
+  if (save_image) {
+    // keep a copy of every object linked, including an image's
+    jit->getObjTransformLayer().setTransform([&](auto&& object)
+      -> Expected<std::unique_ptr<MemoryBuffer>> {
+      image.objects.push_back({CodeMapPlugin::module_name(object->getBufferIdentifier()),
+			       object->getBuffer().str()});
+      return std::move(object);
+    });
+  }
+  timer.phase("jit setup");
+  if (server_path) {
+    return serve(*jit, server_path, optimize, debug_info, has_flag("-time"));
+  }
+
+  Compiler compiler{optimize, debug_info};
   Reader reader {std::cin};
-  auto o = reader.read();
-  auto parsed = Parser::parse(o);
-  // std::cout << o << "\n";
-  compiler.compile(*parsed);
-  compiler.print_code();
-  ThreadSafeModule tsm {
-    std::move(compiler.module_ptr),
-    std::move(compiler.context_ptr)
-  };
-  ExitOnErr(jit->addIRModule(std::move(tsm)));
- 
-  
-  auto interface_buf = MemoryBuffer::getFile("interface.o");
-  if (auto ec = interface_buf.getError()) {
-    return 1;
+  Parser parser {reader.positions};
+
+  if (load_image) {
+    // link the image's modules in the order they were compiled, as
+    // later ones refer to the definitions of earlier ones, then point
+    // the closures and definitions back at them
+    auto objects = std::move(image.objects);
+    image.objects.clear();
+    for (auto&& object : objects) {
+      auto name = object.module + std::string{CodeMapPlugin::object_suffix};
+      ExitOnErr(jit->addObjectFile(MemoryBuffer::getMemBufferCopy(object.bytes, name)));
+    }
+    for (auto&& object : objects) {
+      ExitOnErr(jit->lookup(object.module));
+    }
+    try {
+      image.relocate([&](auto&& address) { return code_map->function(address); });
+    } catch (const std::exception& e) {
+      errs() << "error: " << e.what() << "\n";
+      return 1;
+    }
+    for (auto&& [symbol, value] : image.definitions) {
+      auto global = ExitOnErr(jit->lookup(compiler.definition_name(symbol)));
+      *global.toPtr<Object*>() = value;
+      compiler.definitions.push_back(symbol);
+    }
+    timer.phase("load image");
   }
-  ExitOnErr(jit->addObjectFile(std::move(*interface_buf)));
 
-  // auto object_buf = MemoryBuffer::getFile("object.o");
-  // if (auto ec = object_buf.getError()) {
-  //   return 1;
-  // }
-  // ExitOnErr(jit->addObjectFile(std::move(*object_buf)));  
+  Profile profile;
+  if (profile_use) {
+    try {
+      profile.read(profile_use);
+    } catch (const std::exception& e) {
+      errs() << "error: " << e.what() << "\n";
+      return 1;
+    }
+  }
+  compiler.export_lambdas = save_image != nullptr;
+  compiler.prefix_letrec_names = repl;
+  if (profile_generate || profile_use) {
+    compiler.profile = &profile;
+    compiler.instrument = profile_generate != nullptr;
+  }
+  // after linking a module: the addresses of its lambdas tell the
+  // profile which lambdas closure calls went to
+  auto&& name_lambdas = [&]() {
+    for (auto&& name : compiler.instrumented_lambdas) {
+      auto symbol = jit->lookup(name);
+      if (!symbol) {
+	throw std::runtime_error(toString(symbol.takeError()));
+      }
+      profile.name_function(symbol->toPtr<void*>(), name);
+    }
+  };
+  auto&& write_profile = [&]() {
+    if (!profile_generate) return;
+    // threads still running are still counting
+    memory.join_threads();
+    try {
+      profile.write(profile_generate);
+    } catch (const std::exception& e) {
+      errs() << "error: " << e.what() << "\n";
+    }
+  };
 
-  auto process_dylib_generator =
-    ExitOnErr(DynamicLibrarySearchGenerator
-	      ::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix()));
-  jit->getMainJITDylib().addGenerator(std::move(process_dylib_generator));
-  
-  
-  auto main = ExitOnErr(jit->lookup("main"));
-  main.toPtr<void(*)()>()();
+  if (repl) {
+    // every form goes into its own module, with its own entry point;
+    // the JIT session and the compiler's globals carry over, so
+    // earlier definitions stay linked
+    auto n = image.next_module;
+    for (;; ++n) {
+      errs() << "> ";
+      if (reader.at_end()) break;
+      try {
+	auto o = reader.read();
+	timer.phase("read");
+	auto entry_name = "repl." + std::to_string(n);
+	compiler.begin_module(entry_name);
+	auto is_definition = compile_toplevel(compiler, parser, timer, o);
+	compiler.finish_module();
+	if (auto err = jit->addIRModule(compiler.take_module())) {
+	  throw std::runtime_error(toString(std::move(err)));
+	}
+	auto entry = jit->lookup(entry_name);
+	if (!entry) {
+	  throw std::runtime_error(toString(entry.takeError()));
+	}
+	name_lambdas();
+	auto result = entry->toPtr<Object(*)()>()();
+	if (!is_definition) {
+	  printer.print(result);
+	}
+	printer.flush();
+      } catch (const std::exception& e) {
+	printer.flush();
+	errs() << "error: " << e.what() << "\n";
+      }
+    }
+    errs() << "\n";
+    write_profile();
+    if (save_image) {
+      try {
+	image.definitions.clear();
+	for (auto&& symbol : compiler.definitions) {
+	  auto global = jit->lookup(compiler.definition_name(symbol));
+	  if (!global) {
+	    throw std::runtime_error(toString(global.takeError()));
+	  }
+	  image.definitions.emplace_back(symbol, *global->toPtr<Object*>());
+	}
+	image.next_module = n;
+	image.save(save_image, [&](void* code) { return code_map->code_address(code); });
+      } catch (const std::exception& e) {
+	errs() << "error: " << e.what() << "\n";
+	return 1;
+      }
+    }
+    return 0;
+  }
+
+  auto status = run_program(*jit, jit->getMainJITDylib(), compiler, timer,
+			    name_lambdas);
+  write_profile();
+  return status;
 }
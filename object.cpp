@@ -1,7 +1,19 @@
 #include <stdexcept>
 #include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <unistd.h>
+#include <sys/mman.h>
 #include "decls.hpp"
 
+// the printer is defined first so that it is still around when the
+// destruction of memory waits for running threads
+Printer printer {};
 Memory memory {};
 
 namespace Constants {
@@ -12,13 +24,26 @@ namespace Constants {
   const Object quote = Object{memory.symbol("quote")};
   const Object cons = Object{memory.symbol("cons")};
   const Object lambda = Object{memory.symbol("lambda")};
+  const Object define = Object{memory.symbol("define")};
   const Object t = Object{memory.symbol("t")};
 }
 
-void type_error() {
+// The error routines are kept out of line and marked cold so the
+// checks calling them are laid out with the fast path falling through.
+[[noreturn, gnu::cold, gnu::noinline]] void type_error() {
   throw std::runtime_error("type error");
 }
 
+[[noreturn, gnu::cold, gnu::noinline]] void index_error() {
+  throw std::runtime_error("index out of range");
+}
+
+[[noreturn, gnu::cold, gnu::noinline]] void arity_error(std::int32_t expected,
+							std::int32_t given) {
+  throw std::runtime_error("arity error: expected " + std::to_string(expected)
+			   + " arguments, given " + std::to_string(given));
+}
+
 template <typename S, typename T>
 S bitcast(T& t) {
   static_assert(sizeof(S) == sizeof(T));
@@ -47,34 +72,157 @@ Object::Object(Closure c)
     data{bitcast<std::uint64_t>(c)}
 {}
 
-bool Object::is_number() const { return tag == tag_number; }
+Object::Object(Vector v)
+  : tag{tag_vector},
+    data{bitcast<std::uint64_t>(v)}
+{}
+
+Object::Object(Table t)
+  : tag{tag_table},
+    data{bitcast<std::uint64_t>(t)}
+{}
+
+Object::Object(Thread t)
+  : tag{tag_thread},
+    data{bitcast<std::uint64_t>(t)}
+{}
+
+Object::Object(String s)
+  : tag{tag_string},
+    data{bitcast<std::uint64_t>(s)}
+{}
+
+Object::Object(Port p)
+  : tag{tag_port},
+    data{bitcast<std::uint64_t>(p)}
+{}
+
+Object Object::compact(Object* elements, std::uint64_t length) {
+  Object o {Constants::nil};
+  o.tag = tag_compact | (length << 8);
+  o.data = bitcast<std::uint64_t>(elements);
+  return o;
+}
+
+Object Object::short_string(std::string_view s) {
+  Object o {Constants::nil};
+  o.tag = tag_short_string | (s.size() << 8);
+  o.data = 0;
+  std::memcpy(&o.data, s.data(), s.size());
+  return o;
+}
+
+Object Object::fixnum(std::int64_t i) {
+  Object o {Constants::nil};
+  o.tag = tag_fixnum;
+  o.data = bitcast<std::uint64_t>(i);
+  return o;
+}
+
+Object Object::stream(Port p, Record record) {
+  Object o {Constants::nil};
+  o.tag = tag_stream | (static_cast<std::uint64_t>(record) << 8);
+  o.data = bitcast<std::uint64_t>(p);
+  return o;
+}
+
+bool Object::is_number() const {
+  return tag == tag_number || tag == tag_fixnum;
+}
+
+bool Object::is_fixnum() const { return tag == tag_fixnum; }
 
 bool Object::is_symbol() const { return tag == tag_symbol; }
 
-bool Object::is_cons() const { return tag == tag_cons; }
+bool Object::is_cons() const {
+  return tag == tag_cons || kind() == tag_compact;
+}
 
 bool Object::is_closure() const { return tag == tag_closure; }
 
+bool Object::is_vector() const { return tag == tag_vector; }
+
+bool Object::is_table() const { return tag == tag_table; }
+
+bool Object::is_thread() const { return tag == tag_thread; }
+
+bool Object::is_string() const {
+  return tag == tag_string || kind() == tag_short_string;
+}
+
+bool Object::is_port() const { return tag == tag_port; }
+
 double Object::as_number() const {
-  if (!is_number()) type_error();
+  if (tag == tag_fixnum) return static_cast<double>(as_fixnum());
+  if (tag != tag_number) type_error();
   return bitcast<double>(data);
 }
+std::int64_t Object::as_fixnum() const {
+  if (!is_fixnum()) type_error();
+  return bitcast<std::int64_t>(data);
+}
 Symbol Object::as_symbol() const {
   if (!is_symbol()) type_error();
   return bitcast<Symbol>(data);
 }
 Cons Object::as_cons() const {
-  if (!is_cons()) type_error();
+  if (tag != tag_cons) type_error();
   return bitcast<Cons>(data);
 }
 Closure Object::as_closure() const {
   if (!is_closure()) type_error();
   return bitcast<Closure>(data);
 }
+Vector Object::as_vector() const {
+  if (!is_vector()) type_error();
+  return bitcast<Vector>(data);
+}
+Table Object::as_table() const {
+  if (!is_table()) type_error();
+  return bitcast<Table>(data);
+}
+Thread Object::as_thread() const {
+  if (!is_thread()) type_error();
+  return bitcast<Thread>(data);
+}
+Port Object::as_port() const {
+  if (!is_port()) type_error();
+  return bitcast<Port>(data);
+}
+
+std::string_view Object::as_string() const {
+  if (kind() == tag_short_string) {
+    return {reinterpret_cast<const char*>(&data), tag >> 8};
+  }
+  if (tag != tag_string) type_error();
+  return bitcast<String>(data)->view();
+}
 
-Object& Object::car() const { return as_cons()->car; }
+Object& Object::car() const {
+  if (kind() == tag_compact) {
+    return *bitcast<Object*>(data);
+  }
+  return as_cons()->car;
+}
 
-Object& Object::cdr() const { return as_cons()->cdr; }
+Object Object::cdr() const {
+  if (kind() == tag_compact) {
+    // the next element of the segment, or the tail stored after the
+    // last one
+    auto elements = bitcast<Object*>(data);
+    auto length = tag >> 8;
+    return length > 1 ? compact(elements + 1, length - 1) : elements[1];
+  }
+  auto cell = as_cons();
+  // the rest of a lazy list, which is read once and kept in the cell;
+  // another thread may be storing it, the tag is loaded atomically to
+  // pair with the store that publishes it
+  auto cdr_tag = __atomic_load_n(&cell->cdr.tag, __ATOMIC_ACQUIRE);
+  if (static_cast<Tag>(cdr_tag & 0xff) == tag_stream) {
+    PortData::read_rest(*cell);
+  }
+  return cell->cdr;
+}
 
 bool Object::is_nil() const { return *this == Constants::nil; }
 
@@ -83,56 +231,436 @@ bool operator==(const Object& o1, const Object& o2) {
 }
 
 bool Object::equal(const Object& rhs) const {
+  if (is_cons() && rhs.is_cons()) {
+    // either list representation, iterating along the lists
+    auto p = *this;
+    auto q = rhs;
+    for (; p.is_cons() && q.is_cons(); p = p.cdr(), q = q.cdr()) {
+      if (!p.car().equal(q.car())) return false;
+    }
+    return p.equal(q);
+  }
+  if (is_string() && rhs.is_string()) {
+    return as_string() == rhs.as_string();
+  }
+  if (is_fixnum() != rhs.is_fixnum() && is_number() && rhs.is_number()) {
+    // only if the double is exactly the fixnum's value
+    auto i = is_fixnum() ? as_fixnum() : rhs.as_fixnum();
+    auto d = is_fixnum() ? rhs.as_number() : as_number();
+    return static_cast<double>(i) == d && d < 0x1p63
+      && static_cast<std::int64_t>(d) == i;
+  }
   if (tag != rhs.tag) {
     return false;
   }
   switch (tag) {
   case tag_number:
+  case tag_fixnum:
   case tag_symbol:
+  case tag_closure:
+  case tag_table:
+  case tag_thread:
+  case tag_port:
     return data == rhs.data;
+  case tag_vector:
+    return as_vector()->elements == rhs.as_vector()->elements;
   default:
-  // case tag_cons:
-    return car().equal(rhs.car())
-      && cdr().equal(rhs.cdr());
+    return false;
+  }
+}
+
+std::uint64_t hash_name(std::string_view name);
+
+// splitmix64 finalizer
+std::uint64_t mix(std::uint64_t h) {
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111eb;
+  h ^= h >> 31;
+  return h;
+}
+
+std::uint64_t Object::hash() const {
+  switch (kind()) {
+  case tag_symbol:
+    return as_symbol()->hash;
+  case tag_number:
+  case tag_fixnum: {
+    // fixnums hash as the double they are equal to, adding 0.0 turns
+    // -0.0 (which equals the fixnum 0) into 0.0
+    auto d = as_number() + 0.0;
+    return mix(bitcast<std::uint64_t>(d) ^ (std::uint64_t{tag_number} << 56));
+  }
+  case tag_closure:
+  case tag_table:
+  case tag_thread:
+  case tag_port:
+    return mix(data ^ (tag << 56));
+  case tag_vector: {
+    std::uint64_t h = tag;
+    for (auto e : as_vector()->elements) {
+      // adding 0.0 turns -0.0 into 0.0, which compare equal
+      e += 0.0;
+      h = mix(h ^ bitcast<std::uint64_t>(e));
+    }
+    return h;
+  }
+  case tag_string:
+  case tag_short_string:
+    return mix(hash_name(as_string()) ^ (std::uint64_t{tag_string} << 56));
+  default: {
+  // case tag_cons, tag_compact:
+    // recurse on the elements, but iterate along the list
+    std::uint64_t h = tag_cons;
+    auto p = *this;
+    for (; p.is_cons(); p = p.cdr()) {
+      h = mix(h ^ p.car().hash());
+    }
+    return mix(h ^ p.hash());
+  }
   }
 }
 
+TableData::TableData()
+  : entries(16, Entry{Constants::nil, Constants::nil, false})
+{}
+
+auto TableData::find(const Object& key, std::uint64_t hash) -> Entry& {
+  auto mask = entries.size() - 1;
+  auto i = hash & mask;
+  while (entries[i].used && !entries[i].key.equal(key)) {
+    i = (i + 1) & mask;
+  }
+  return entries[i];
+}
+
+Object* TableData::get(const Object& key) {
+  auto&& entry = find(key, key.hash());
+  return entry.used ? &entry.value : nullptr;
+}
+
+void TableData::put(const Object& key, const Object& value) {
+  auto hash = key.hash();
+  auto* entry = &find(key, hash);
+  if (entry->used) {
+    entry->value = value;
+    return;
+  }
+  if (2 * (count + 1) > entries.size()) {
+    std::vector<Entry> old(entries.size() * 2,
+			   Entry{Constants::nil, Constants::nil, false});
+    std::swap(old, entries);
+    for (auto&& e : old) {
+      if (e.used) find(e.key, e.key.hash()) = e;
+    }
+    entry = &find(key, hash);
+  }
+  *entry = Entry{key, value, true};
+  ++count;
+}
+
+// the part of its current block that a thread has not allocated yet
+struct AllocationBuffer {
+  char* next {nullptr};
+  char* end {nullptr};
+};
+
+thread_local AllocationBuffer allocation_buffer {};
+
+Heap::Heap() {
+  // reserving costs nothing until the pages are made accessible by
+  // block; without MAP_FIXED_NOREPLACE the address is only a hint
+  auto hint = reinterpret_cast<void*>(address);
+  auto flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+  auto p = mmap(hint, reserved, PROT_NONE, flags | MAP_FIXED_NOREPLACE, -1, 0);
+  if (p == MAP_FAILED) {
+    // taken, so anywhere else, without images
+    p = mmap(nullptr, reserved, PROT_NONE, flags, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc{};
+  }
+  at_address = p == hint;
+  base = next = static_cast<char*>(p);
+  end = base + reserved;
+}
+
+char* Heap::block(std::size_t size) {
+  static const std::size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) & ~(page_size - 1);
+  std::lock_guard lock{mutex};
+  if (size > static_cast<std::size_t>(end - next)
+      || mprotect(next, size, PROT_READ | PROT_WRITE) != 0) {
+    throw std::bad_alloc{};
+  }
+  auto res = next;
+  next += size;
+  return res;
+}
+
+char* Heap::used_end() {
+  std::lock_guard lock{mutex};
+  return next;
+}
+
+void Heap::map(int fd, std::uint64_t offset, std::size_t size) {
+  std::lock_guard lock{mutex};
+  if (!at_address) {
+    throw std::runtime_error("the heap isn't at its fixed address");
+  }
+  // the blocks handed out so far must be in the image as well
+  if (size < static_cast<std::size_t>(next - base)
+      || size > static_cast<std::size_t>(end - base)) {
+    throw std::runtime_error("image doesn't fit the heap");
+  }
+  if (mmap(base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	   fd, offset) == MAP_FAILED) {
+    throw std::runtime_error(std::string{"can't map image: "} + std::strerror(errno));
+  }
+  next = base + size;
+}
+
+char* Memory::new_block(std::size_t size) {
+  return heap.block(size);
+}
+
+void Memory::drop_allocation_buffer() {
+  allocation_buffer = {};
+}
+
+void* Memory::allocate(std::size_t size) {
+  // keep everything 16 byte aligned
+  size = (size + 15) & ~std::size_t{15};
+  auto&& buf = allocation_buffer;
+  if (size > static_cast<std::size_t>(buf.end - buf.next)) {
+    if (size > block_size / 4) {
+      // don't waste the rest of the current block on a big object
+      return new_block(size);
+    }
+    buf.next = new_block(block_size);
+    buf.end = buf.next + block_size;
+  }
+  auto res = buf.next;
+  buf.next += size;
+  return res;
+}
+
 Cons Memory::cons(Object car, Object cdr) {
-  conses.emplace_back(car, cdr);
-  return &conses.back();
+  return new (allocate(sizeof(Cell))) Cell{car, cdr};
 }
 
-Symbol Memory::symbol(const std::string& s) {
-  auto [it, did_insert] = symbol_lookup.insert({s, nullptr});
-  if (did_insert) {
-    symbol_storage.push_back(s);
-    it->second = &symbol_storage.back();
+Object Memory::list(const Object* elements, std::size_t n, Object tail) {
+  if (compact_lists && n > 0) {
+    auto segment = static_cast<Object*>(allocate((n+1) * sizeof(Object)));
+    std::uninitialized_copy(elements, elements + n, segment);
+    new (segment + n) Object{tail};
+    return Object::compact(segment, n);
+  }
+  auto res = tail;
+  for (auto i = n; i-- > 0;) {
+    res = Object{cons(elements[i], res)};
   }
-  return it->second;
+  return res;
+}
+
+Object Memory::list(const std::vector<Object>& elements) {
+  return list(elements.data(), elements.size(), Constants::nil);
+}
+
+// 64 bit FNV-1a
+std::uint64_t hash_name(std::string_view name) {
+  std::uint64_t h = 0xcbf29ce484222325;
+  for (auto c : name) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+SymbolTable::SymbolTable(Heap& heap)
+  : heap{heap}, slots(1024, nullptr)
+{}
+
+Symbol SymbolTable::find(std::string_view name, std::uint64_t hash) const {
+  auto mask = slots.size() - 1;
+  for (auto i = hash & mask; slots[i]; i = (i + 1) & mask) {
+    auto s = slots[i];
+    if (s->hash == hash && s->name() == name) {
+      return s;
+    }
+  }
+  return nullptr;
+}
+
+Symbol SymbolTable::allocate(std::string_view name, std::uint64_t hash) {
+  constexpr auto align = alignof(SymbolData);
+  auto size = (sizeof(SymbolData) + name.size() + 1 + align - 1) & ~(align - 1);
+  if (size > static_cast<std::size_t>(block_end - block_next)) {
+    auto n = std::max(size, block_size);
+    block_next = heap.block(n);
+    block_end = block_next + n;
+  }
+  auto s = new (block_next) SymbolData{hash, static_cast<std::uint32_t>(name.size())};
+  auto chars = reinterpret_cast<char*>(s + 1);
+  std::memcpy(chars, name.data(), name.size());
+  chars[name.size()] = '\0';
+  block_next += size;
+  return s;
+}
+
+void SymbolTable::insert(Symbol s) {
+  auto mask = slots.size() - 1;
+  auto i = s->hash & mask;
+  while (slots[i]) {
+    i = (i + 1) & mask;
+  }
+  slots[i] = s;
+}
+
+Symbol SymbolTable::intern(std::string_view name) {
+  auto hash = hash_name(name);
+  {
+    std::shared_lock lock{mutex};
+    if (auto s = find(name, hash)) {
+      return s;
+    }
+  }
+  std::unique_lock lock{mutex};
+  // someone else may have inserted it in the meantime
+  if (auto s = find(name, hash)) {
+    return s;
+  }
+  // keep the load factor at most 1/2
+  if (2 * (count + 1) > slots.size()) {
+    std::vector<Symbol> old(slots.size() * 2, nullptr);
+    std::swap(old, slots);
+    for (auto s : old) {
+      if (s) insert(s);
+    }
+  }
+  auto s = allocate(name, hash);
+  insert(s);
+  ++count;
+  return s;
+}
+
+Symbol Memory::symbol(std::string_view s) {
+  return symbols.intern(s);
+}
+
+Object Memory::string(std::string_view s) {
+  if (s.size() <= Object::short_string_length) {
+    return Object::short_string(s);
+  }
+  auto str = string_buffer(s.size());
+  std::memcpy(str->chars(), s.data(), s.size());
+  return Object{str};
+}
+
+String Memory::string_buffer(std::size_t length) {
+  return new (allocate(sizeof(StringData) + length)) StringData{length};
 }
 
 Closure Memory::closure(void* code,
 			Object* fvs, std::int32_t n_fvs,
 			std::int32_t n_params) {
-  closures.emplace_back(code,
-			std::vector<Object>(fvs, fvs+n_fvs),
-			n_params);
-  return &closures.back();  
+  auto mem = allocate(sizeof(ClosureData) + n_fvs * sizeof(Object));
+  auto cl = new (mem) ClosureData{code, n_params, n_fvs};
+  std::uninitialized_copy(fvs, fvs + n_fvs, cl->fvs());
+  return cl;
+}
+
+Vector Memory::vector(std::vector<double>&& elements) {
+  std::lock_guard lock{mutex};
+  vectors.emplace_back(std::move(elements));
+  return &vectors.back();
+}
+
+Table Memory::table() {
+  std::lock_guard lock{mutex};
+  tables.emplace_back();
+  return &tables.back();
+}
+
+Thread Memory::thread(Object f) {
+  std::lock_guard lock{mutex};
+  threads.emplace_back(f);
+  return &threads.back();
+}
+
+void Memory::join_threads() {
+  // the list is only walked under the lock, threads spawned while
+  // waiting are added at its end
+  std::unique_lock lock{mutex};
+  for (auto it = threads.begin(); it != threads.end(); ++it) {
+    lock.unlock();
+    it->wait();
+    lock.lock();
+  }
+}
+
+Port Memory::port(std::FILE* file, bool owned) {
+  std::lock_guard lock{mutex};
+  ports.emplace_back(file, owned);
+  return &ports.back();
+}
+
+Port Memory::standard_input() {
+  std::lock_guard lock{mutex};
+  if (!standard_input_port) {
+    ports.emplace_back(stdin, false);
+    standard_input_port = &ports.back();
+  }
+  return standard_input_port;
+}
+
+void Memory::reset_standard_input() {
+  Port port;
+  {
+    std::lock_guard lock{mutex};
+    port = std::exchange(standard_input_port, nullptr);
+  }
+  if (port) port->close();
+}
+
+// a string as it is written in the source: in double quotes, with
+// backslashes before quotes and backslashes and escapes for newlines
+// and tabs
+std::string escape(std::string_view s) {
+  std::string res {"\""};
+  for (auto c : s) {
+    switch (c) {
+    case '"': res += "\\\""; break;
+    case '\\': res += "\\\\"; break;
+    case '\n': res += "\\n"; break;
+    case '\t': res += "\\t"; break;
+    default: res += c;
+    }
+  }
+  res += '"';
+  return res;
 }
 
 std::ostream& operator<<(std::ostream& os, Object o) {
-  switch (o.tag) {
+  switch (o.kind()) {
   case Object::tag_number:
     os << o.as_number();
     break;
+  case Object::tag_fixnum:
+    os << o.as_fixnum();
+    break;
   case Object::tag_symbol:
-    os << *o.as_symbol();
+    os << o.as_symbol()->name();
+    break;
+  case Object::tag_string:
+  case Object::tag_short_string:
+    os << escape(o.as_string());
     break;
-  case Object::tag_cons: {
+  case Object::tag_cons:
+  case Object::tag_compact: {
     os << "(";
     for (auto p = o; p.is_cons(); p = p.cdr()) {
       os << p.car();
-      auto& cdr = p.cdr();
+      auto cdr = p.cdr();
       if (cdr.is_nil()) {
 	os << ")";
       } else if (!cdr.is_cons()) {
@@ -143,85 +671,713 @@ std::ostream& operator<<(std::ostream& os, Object o) {
     }
     break;      
   }
+  case Object::tag_vector: {
+    os << "#(";
+    auto&& elements = o.as_vector()->elements;
+    for (std::size_t i = 0; i < elements.size(); ++i) {
+      os << (i ? " " : "") << elements[i];
+    }
+    os << ")";
+    break;
+  }
+  case Object::tag_closure:
+    os << "#<closure>";
+    break;
+  case Object::tag_table:
+    os << "#<table>";
+    break;
+  case Object::tag_thread:
+    os << "#<thread>";
+    break;
+  case Object::tag_port:
+  // only ever in the cdr of a cell, which cdr reads through
+  case Object::tag_stream:
+    os << "#<port>";
+    break;
   }
   return os;
 }
 
+Printer::Printer()
+  : line_buffered{static_cast<bool>(isatty(STDOUT_FILENO))}
+{}
+
+Printer::~Printer() {
+  flush();
+}
+
+void Printer::check_terminal() {
+  std::lock_guard lock{mutex};
+  line_buffered = isatty(STDOUT_FILENO);
+}
+
+void Printer::flush() {
+  std::lock_guard lock{mutex};
+  write_out();
+}
+
+void Printer::write_out() {
+  std::fwrite(buffer.get(), 1, used, stdout);
+  std::fflush(stdout);
+  used = 0;
+}
+
+void Printer::write(std::string_view s) {
+  if (s.size() > buffer_size - used) {
+    write_out();
+    if (s.size() > buffer_size) {
+      std::fwrite(s.data(), 1, s.size(), stdout);
+      return;
+    }
+  }
+  std::memcpy(buffer.get() + used, s.data(), s.size());
+  used += s.size();
+}
+
+void Printer::write(std::int64_t i) {
+  char chars[24];
+  auto res = std::to_chars(chars, chars + sizeof chars, i);
+  write({chars, static_cast<std::size_t>(res.ptr - chars)});
+}
+
+void Printer::write(double d) {
+  // same format as operator<<, i.e. %g with the default precision of 6
+  char chars[32];
+  auto res = std::to_chars(chars, chars + sizeof chars, d,
+			   std::chars_format::general, 6);
+  write({chars, static_cast<std::size_t>(res.ptr - chars)});
+}
+
+// Same output as operator<<, but iterative: nested lists push their
+// remaining elements on an explicit stack instead of recursing.
+void Printer::print(Object o) {
+  std::lock_guard lock{mutex};
+  stack.push_back({Frame::value, o});
+  while (!stack.empty()) {
+    auto frame = stack.back();
+    stack.pop_back();
+    switch (frame.kind) {
+    case Frame::close:
+      write(")");
+      break;
+    case Frame::rest: {
+      // the car of frame.o has been printed, continue with the cdr
+      auto cdr = frame.o.cdr();
+      if (cdr.is_nil()) {
+	write(")");
+      } else if (!cdr.is_cons()) {
+	write(" . ");
+	stack.push_back({Frame::close, cdr});
+	stack.push_back({Frame::value, cdr});
+      } else {
+	write(" ");
+	stack.push_back({Frame::rest, cdr});
+	stack.push_back({Frame::value, cdr.car()});
+      }
+      break;
+    }
+    case Frame::value:
+      switch (frame.o.kind()) {
+      case Object::tag_number:
+	write(frame.o.as_number());
+	break;
+      case Object::tag_fixnum:
+	write(frame.o.as_fixnum());
+	break;
+      case Object::tag_symbol:
+	write(frame.o.as_symbol()->name());
+	break;
+      case Object::tag_string:
+      case Object::tag_short_string:
+	write(escape(frame.o.as_string()));
+	break;
+      case Object::tag_cons:
+      case Object::tag_compact:
+	write("(");
+	stack.push_back({Frame::rest, frame.o});
+	stack.push_back({Frame::value, frame.o.car()});
+	break;
+      case Object::tag_vector: {
+	write("#(");
+	auto&& elements = frame.o.as_vector()->elements;
+	for (std::size_t i = 0; i < elements.size(); ++i) {
+	  if (i) write(" ");
+	  write(elements[i]);
+	}
+	write(")");
+	break;
+      }
+      case Object::tag_closure:
+	write("#<closure>");
+	break;
+      case Object::tag_table:
+	write("#<table>");
+	break;
+      case Object::tag_thread:
+	write("#<thread>");
+	break;
+      case Object::tag_port:
+      case Object::tag_stream:
+	write("#<port>");
+	break;
+      }
+      break;
+    }
+  }
+  write("\n");
+  if (line_buffered) {
+    write_out();
+  }
+}
+
+// calls a closure from the runtime, in the same way the generated
+// call_closure functions do
+template <typename... Args>
+Object apply_closure(const Object& f, Args... args) {
+  auto&& cl = *f.as_closure();
+  if (cl.n_params != sizeof...(Args)) arity_error(cl.n_params, sizeof...(Args));
+  auto code = reinterpret_cast<Object(*)(Object*, Args...)>(cl.code);
+  return code(cl.fvs(), args...);
+}
+
+ThreadData::ThreadData(Object f)
+  : result{Constants::nil},
+    thread{[this, f]() {
+      try {
+	result = apply_closure(f);
+      } catch (...) {
+	error = std::current_exception();
+      }
+    }}
+{}
+
+ThreadData::~ThreadData() {
+  wait();
+}
+
+void ThreadData::wait() {
+  std::call_once(joined, [&]() { thread.join(); });
+}
+
+Object ThreadData::join() {
+  wait();
+  if (error) std::rethrow_exception(error);
+  return result;
+}
+
+PortData::PortData(std::FILE* file, bool owned)
+  : file{file}, owned{owned}
+{
+  if (owned) std::setvbuf(file, nullptr, _IOFBF, buffer_size);
+}
+
+PortData::~PortData() {
+  if (owned && file) std::fclose(file);
+  std::free(line);
+}
+
+auto PortData::underflow() -> int_type {
+  if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+  if (!file) return traits_type::eof();
+  // at the end of the input the last line stays the get area, so that
+  // the tokenizer can still unget into it
+  auto n = getdelim(&line, &capacity, '\n', file);
+  if (n <= 0) return traits_type::eof();
+  setg(line, line, line + n);
+  return traits_type::to_int_type(*gptr());
+}
+
+std::optional<Object> PortData::next(Record record) {
+  if (record == Record::datum) {
+    // a terminal can go on after the end of the input
+    stream.clear();
+    if (reader.at_end()) return std::nullopt;
+    auto o = reader.read();
+    reader.positions.clear();
+    return o;
+  }
+  if (gptr() == egptr() && underflow() == traits_type::eof()) {
+    return std::nullopt;
+  }
+  std::string_view rest {gptr(), static_cast<std::size_t>(egptr() - gptr())};
+  setg(eback(), egptr(), egptr());
+  if (!rest.empty() && rest.back() == '\n') rest.remove_suffix(1);
+  return memory.string(rest);
+}
+
+Object PortData::read(Record record) {
+  std::lock_guard lock{mutex};
+  return next(record).value_or(Constants::nil);
+}
+
+Object PortData::read_list(Record record) {
+  std::lock_guard lock{mutex};
+  auto element = next(record);
+  if (!element) return Constants::nil;
+  return Object{memory.cons(*element, Object::stream(this, record))};
+}
+
+// the cdrs of lazy lists are only replaced under one of these, picked
+// by the cell's address
+std::mutex stream_cell_locks[16];
+
+void PortData::read_rest(Cell& cell) {
+  auto&& cell_lock =
+    stream_cell_locks[reinterpret_cast<std::uintptr_t>(&cell) / sizeof(Cell) % 16];
+  std::lock_guard lock{cell_lock};
+  // another thread may have got there first
+  auto stream = cell.cdr;
+  if (stream.kind() != Object::tag_stream) return;
+  auto port = bitcast<Port>(stream.data);
+  auto record = static_cast<Record>(stream.tag >> 8);
+  auto rest = Constants::nil;
+  {
+    std::lock_guard port_lock{port->mutex};
+    if (auto element = port->next(record)) {
+      rest = Object{memory.cons(*element, Object::stream(port, record))};
+    }
+  }
+  // the data goes first, a thread that sees the new tag finds it
+  cell.cdr.data = rest.data;
+  __atomic_store_n(&cell.cdr.tag, rest.tag, __ATOMIC_RELEASE);
+}
+
+void PortData::close() {
+  std::lock_guard lock{mutex};
+  if (owned && file) std::fclose(file);
+  file = nullptr;
+  setg(nullptr, nullptr, nullptr);
+  std::free(line);
+  line = nullptr;
+  capacity = 0;
+}
+
+std::size_t as_index(const Object& o) {
+  if (o.is_fixnum()) {
+    if (o.as_fixnum() < 0) type_error();
+    return o.as_fixnum();
+  }
+  auto d = o.as_number();
+  // the range is checked first, converting a double that doesn't fit
+  // (or a NaN) is undefined
+  if (!(std::isfinite(d) && d >= 0 && d < 0x1p64)
+      || d != static_cast<std::size_t>(d)) {
+    type_error();
+  }
+  return static_cast<std::size_t>(d);
+}
+
+// a fixnum against a double, without converting the fixnum to a
+// double, which rounds above 2^53: -1, 0 or 1 as the fixnum is less
+// than, equal to or greater than the double, 2 if that is a NaN
+int compare_fixnum(std::int64_t i, double d) {
+  if (std::isnan(d)) return 2;
+  if (d >= 0x1p63) return -1;
+  if (d < -0x1p63) return 1;
+  auto whole = std::trunc(d);
+  auto j = static_cast<std::int64_t>(whole);
+  if (i != j) return i < j ? -1 : 1;
+  return whole < d ? -1 : whole > d ? 1 : 0;
+}
+
+// -1, 0 or 1 as o1 is less than, equal to or greater than o2, 2 if
+// they are unordered
+int compare_numbers(const Object& o1, const Object& o2) {
+  if (o1.is_fixnum() && o2.is_fixnum()) {
+    auto i = o1.as_fixnum();
+    auto j = o2.as_fixnum();
+    return (i > j) - (i < j);
+  }
+  if (o1.is_fixnum()) {
+    return compare_fixnum(o1.as_fixnum(), o2.as_number());
+  }
+  if (o2.is_fixnum()) {
+    auto c = compare_fixnum(o2.as_fixnum(), o1.as_number());
+    return c == 2 ? c : -c;
+  }
+  auto d1 = o1.as_number();
+  auto d2 = o2.as_number();
+  return d1 < d2 ? -1 : d1 > d2 ? 1 : d1 == d2 ? 0 : 2;
+}
+
+// the reductions keep a fixed number of independent partial sums so the
+// loop body maps straight onto simd lanes, without having to
+// reassociate a single running sum
+constexpr std::size_t lanes = 8;
+
+double sum_kernel(const double* a, std::size_t n) {
+  double acc[lanes] = {};
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (std::size_t j = 0; j < lanes; ++j) {
+      acc[j] += a[i+j];
+    }
+  }
+  double sum = 0;
+  for (auto&& x : acc) sum += x;
+  for (; i < n; ++i) sum += a[i];
+  return sum;
+}
+
+double dot_kernel(const double* a, const double* b, std::size_t n) {
+  double acc[lanes] = {};
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (std::size_t j = 0; j < lanes; ++j) {
+      acc[j] += a[i+j] * b[i+j];
+    }
+  }
+  double sum = 0;
+  for (auto&& x : acc) sum += x;
+  for (; i < n; ++i) sum += a[i] * b[i];
+  return sum;
+}
+
+// Entry points for the generated code. Objects are passed and returned
+// by value: as a 16 byte struct of two integers they travel in a pair
+// of registers under the SysV ABI, which is how llvm lowers the
+// {i64, i64} Object type. No entry point takes more than three Objects,
+// so they never run out of argument registers.
 extern "C" { 
-  void _add(Object* out, Object* o1, Object* o2) {
-    if (!o1->is_number() || !o2->is_number())
+  Object _add(Object o1, Object o2) {
+    std::int64_t i;
+    if (o1.is_fixnum() && o2.is_fixnum()
+	&& !__builtin_add_overflow(o1.as_fixnum(), o2.as_fixnum(), &i)) {
+      return Object::fixnum(i);
+    }
+    if (!o1.is_number() || !o2.is_number())
       type_error();
 
-    *out = Object{o1->as_number() + o2->as_number()};
+    return Object{o1.as_number() + o2.as_number()};
   }
 
-  void _sub(Object* out, Object* o1, Object* o2) {
-    if (!o1->is_number() || !o2->is_number())
+  Object _sub(Object o1, Object o2) {
+    std::int64_t i;
+    if (o1.is_fixnum() && o2.is_fixnum()
+	&& !__builtin_sub_overflow(o1.as_fixnum(), o2.as_fixnum(), &i)) {
+      return Object::fixnum(i);
+    }
+    if (!o1.is_number() || !o2.is_number())
       type_error();
 
-    *out = Object{o1->as_number() - o2->as_number()};
+    return Object{o1.as_number() - o2.as_number()};
   }
 
-  void _mult(Object* out, Object* o1, Object* o2) {
-    if (!o1->is_number() || !o2->is_number())
+  Object _mult(Object o1, Object o2) {
+    std::int64_t i;
+    if (o1.is_fixnum() && o2.is_fixnum()
+	&& !__builtin_mul_overflow(o1.as_fixnum(), o2.as_fixnum(), &i)) {
+      return Object::fixnum(i);
+    }
+    if (!o1.is_number() || !o2.is_number())
       type_error();
 
-    *out = Object{o1->as_number() * o2->as_number()};
+    return Object{o1.as_number() * o2.as_number()};
   }
 
-  void __div(Object* out, Object* o1, Object* o2) {
-    if (!o1->is_number() || !o2->is_number())
+  // always a double, there are no rationals
+  Object __div(Object o1, Object o2) {
+    if (!o1.is_number() || !o2.is_number())
       type_error();
 
-    *out = Object{o1->as_number() / o2->as_number()};
+    return Object{o1.as_number() / o2.as_number()};
+  }
+
+  Object _cons(Object o1, Object o2) {
+    return Object{memory.cons(o1, o2)};
+  }
+
+  Object _car(Object o1) {
+    return o1.car();
+  }
+
+  Object _cdr(Object o1) {
+    return o1.cdr();
+  }
+
+  Object _make_number(double d) {
+    return Object{d};
+  }
+
+  Object _make_symbol(const char* data) {
+    return Object{memory.symbol(data)};
+  }
+
+  bool _is_nil(Object o1) {
+    return o1.is_nil();
+  }
+
+  Object _print(Object o1) {
+    printer.print(o1);
+    return o1;
+  }
+
+  Object _equal(Object o1, Object o2) {
+    return o1.equal(o2) ? Constants::t : Constants::nil;
+  }
+
+  bool _is_equal(Object o1, Object o2) {
+    return o1.equal(o2);
+  }
+
+  Object _lt(Object o1, Object o2) {
+    auto c = compare_numbers(o1, o2);
+    return c == -1 ? Constants::t : Constants::nil;
   }
 
-  void _cons(Object* out, Object* o1, Object* o2) {
-    *out = Object{memory.cons(*o1, *o2)};
+  Object _gt(Object o1, Object o2) {
+    auto c = compare_numbers(o1, o2);
+    return c == 1 ? Constants::t : Constants::nil;
   }
 
-  void _car(Object* out, Object* o1) {
-    *out = o1->car();
+  Object _le(Object o1, Object o2) {
+    auto c = compare_numbers(o1, o2);
+    return c == -1 || c == 0 ? Constants::t : Constants::nil;
   }
 
-  void _cdr(Object* out, Object* o1) {
-    *out = o1->cdr();
+  Object _ge(Object o1, Object o2) {
+    auto c = compare_numbers(o1, o2);
+    return c == 1 || c == 0 ? Constants::t : Constants::nil;
   }
 
-  void _make_number(Object* out, double d) {
-    *out = Object{d};
+  Object _num_eq(Object o1, Object o2) {
+    auto c = compare_numbers(o1, o2);
+    return c == 0 ? Constants::t : Constants::nil;
   }
 
-  void _make_symbol(Object* out, const char* data) {
-    *out = Object{memory.symbol(data)};
+  Object _number_p(Object o1) {
+    return o1.is_number() ? Constants::t : Constants::nil;
+  }
+
+  Object _symbol_p(Object o1) {
+    return o1.is_symbol() ? Constants::t : Constants::nil;
+  }
+
+  Object _cons_p(Object o1) {
+    return o1.is_cons() ? Constants::t : Constants::nil;
+  }
+
+  Object _closure_p(Object o1) {
+    return o1.is_closure() ? Constants::t : Constants::nil;
+  }
+
+  Object _vector_p(Object o1) {
+    return o1.is_vector() ? Constants::t : Constants::nil;
+  }
+
+  Object _make_table() {
+    return Object{memory.table()};
+  }
+
+  Object _table_get(Object o1, Object o2) {
+    auto value = o1.as_table()->get(o2);
+    return value ? *value : Constants::nil;
+  }
+
+  Object _table_put(Object o1, Object o2, Object o3) {
+    o1.as_table()->put(o2, o3);
+    return o3;
+  }
+
+  Object _table_count(Object o1) {
+    return Object::fixnum(o1.as_table()->count);
+  }
+
+  Object _table_p(Object o1) {
+    return o1.is_table() ? Constants::t : Constants::nil;
+  }
+
+  Object _spawn(Object o1) {
+    o1.as_closure();
+    return Object{memory.thread(o1)};
+  }
+
+  Object _join(Object o1) {
+    return o1.as_thread()->join();
+  }
+
+  Object _pmap(Object o1, Object o2) {
+    o1.as_closure();
+    std::vector<Object> elements;
+    if (o2.is_vector()) {
+      for (auto d : o2.as_vector()->elements) {
+	elements.emplace_back(d);
+      }
+    } else {
+      for (auto p = o2; !p.is_nil(); p = p.cdr()) {
+	elements.push_back(p.car());
+      }
+    }
+
+    // a few chunks per worker, so that stealing can even out closures
+    // that take different amounts of time
+    auto&& pool = ThreadPool::instance();
+    auto n = elements.size();
+    auto chunk_size = std::max<std::size_t>(1, n / (4 * pool.size()));
+    std::vector<Object> results(n, Constants::nil);
+    std::vector<std::function<void()>> tasks;
+    for (std::size_t begin = 0; begin < n; begin += chunk_size) {
+      auto end = std::min(n, begin + chunk_size);
+      tasks.emplace_back([&, begin, end]() {
+	for (auto i = begin; i < end; ++i) {
+	  results[i] = apply_closure(o1, elements[i]);
+	}
+      });
+    }
+    // rethrows the first error a closure raised
+    pool.run(std::move(tasks));
+
+    if (o2.is_vector()) {
+      std::vector<double> res;
+      for (auto&& r : results) {
+	res.push_back(r.as_number());
+      }
+      return Object{memory.vector(std::move(res))};
+    }
+    return memory.list(results);
   }
 
-  bool _is_nil(Object* o1) {
-    return o1->is_nil();
+  Object _make_list(const Object* elements, std::int64_t n, Object tail) {
+    return memory.list(elements, n, tail);
   }
 
-  void _print(Object* out, Object* o1) {
-    std::cout << *o1 << "\n";
-    *out = *o1;
+  Object _string_p(Object o1) {
+    return o1.is_string() ? Constants::t : Constants::nil;
   }
 
-  void _equal(Object* out, Object* o1, Object* o2) {
-    *out = o1->equal(*o2) ? Constants::t : Constants::nil;
+  Object _string_length(Object o1) {
+    return Object::fixnum(o1.as_string().size());
   }
 
-  void* _get_code(Object* o1, std::int32_t n) {
-    auto&& cl = *o1->as_closure();
-    if (cl.n_params != n) type_error();
-    return cl.code;
+  Object _string_append(Object o1, Object o2) {
+    auto s1 = o1.as_string();
+    auto s2 = o2.as_string();
+    auto length = s1.size() + s2.size();
+    if (length <= Object::short_string_length) {
+      char chars[Object::short_string_length];
+      std::memcpy(chars, s1.data(), s1.size());
+      std::memcpy(chars + s1.size(), s2.data(), s2.size());
+      return Object::short_string({chars, length});
+    }
+    auto str = memory.string_buffer(length);
+    std::memcpy(str->chars(), s1.data(), s1.size());
+    std::memcpy(str->chars() + s1.size(), s2.data(), s2.size());
+    return Object{str};
+  }
+
+  Object _substring(Object o1, Object o2, Object o3) {
+    auto s = o1.as_string();
+    auto start = as_index(o2);
+    auto end = as_index(o3);
+    if (start > end || end > s.size()) index_error();
+    return memory.string(s.substr(start, end - start));
+  }
+
+  Object _string_to_symbol(Object o1) {
+    return Object{memory.symbol(o1.as_string())};
+  }
+
+  Object _symbol_to_string(Object o1) {
+    return memory.string(o1.as_symbol()->name());
+  }
+
+  Object _open_input_file(Object o1) {
+    std::string path {o1.as_string()};
+    auto file = std::fopen(path.c_str(), "r");
+    if (!file) {
+      throw std::runtime_error("can't open " + path + ": " + std::strerror(errno));
+    }
+    return Object{memory.port(file, true)};
+  }
+
+  Object _standard_input() {
+    // one port, so that what one read buffered the next still sees
+    return Object{memory.standard_input()};
+  }
+
+  Object _read_line(Object o1) {
+    return o1.as_port()->read(Record::line);
+  }
+
+  Object _read_datum(Object o1) {
+    return o1.as_port()->read(Record::datum);
+  }
+
+  Object _read_lines(Object o1) {
+    return o1.as_port()->read_list(Record::line);
+  }
+
+  Object _read_data(Object o1) {
+    return o1.as_port()->read_list(Record::datum);
+  }
+
+  Object _close_input(Object o1) {
+    o1.as_port()->close();
+    return Constants::nil;
+  }
+
+  Object _port_p(Object o1) {
+    return o1.is_port() ? Constants::t : Constants::nil;
+  }
+
+  Object _null_p(Object o1) {
+    return o1.is_nil() ? Constants::t : Constants::nil;
+  }
+
+  // generated code checks the closure header inline and only calls
+  // here when the callee is not a closure or takes n != n_params
+  [[noreturn, gnu::cold]] void _call_error(Object o1, std::int32_t n) {
+    arity_error(o1.as_closure()->n_params, n);
+  }
+
+  Object _create_closure(void* code,
+			 Object* fvs, std::int32_t n_fvs,
+			 std::int32_t n_params) {
+    return Object{memory.closure(code, fvs, n_fvs, n_params)};
+  }
+
+  Object _make_vector(Object o1, Object o2) {
+    return Object{memory.vector(std::vector<double>(as_index(o1),
+						    o2.as_number()))};
+  }
+
+  Object _list_to_vector(Object o1) {
+    std::vector<double> elements;
+    for (auto p = o1; !p.is_nil(); p = p.cdr()) {
+      elements.push_back(p.car().as_number());
+    }
+    return Object{memory.vector(std::move(elements))};
+  }
+
+  Object _vector_length(Object o1) {
+    return Object::fixnum(o1.as_vector()->elements.size());
+  }
+
+  Object _vector_ref(Object o1, Object o2) {
+    auto&& elements = o1.as_vector()->elements;
+    auto i = as_index(o2);
+    if (i >= elements.size()) index_error();
+    return Object{elements[i]};
+  }
+
+  Object _vector_map(Object o1, Object o2) {
+    auto&& elements = o2.as_vector()->elements;
+    std::vector<double> res(elements.size());
+    for (std::size_t i = 0; i < elements.size(); ++i) {
+      res[i] = apply_closure(o1, Object{elements[i]}).as_number();
+    }
+    return Object{memory.vector(std::move(res))};
   }
 
-  Object* _get_fvs(Object* o1) {
-    return o1->as_closure()->fvs.data();
+  Object _vector_sum(Object o1) {
+    auto&& elements = o1.as_vector()->elements;
+    return Object{sum_kernel(elements.data(), elements.size())};
   }
 
-  void _create_closure(Object* out, void* code,
-		       Object* fvs, std::int32_t n_fvs,
-		       std::int32_t n_params) {
-    *out = Object{memory.closure(code, fvs, n_fvs, n_params)};
+  Object _dot(Object o1, Object o2) {
+    auto&& e1 = o1.as_vector()->elements;
+    auto&& e2 = o2.as_vector()->elements;
+    if (e1.size() != e2.size()) type_error();
+    return Object{dot_kernel(e1.data(), e2.data(), e1.size())};
   }
 }
@@ -1,9 +1,27 @@
+#include <charconv>
 #include "decls.hpp"
   
 Tokenizer::Tokenizer(std::istream& is)
   : is{is}
 {}
 
+int Tokenizer::get() {
+  auto c = is.get();
+  last_position = curr_position;
+  if (c == '\n') {
+    ++curr_position.line;
+    curr_position.column = 0;
+  } else {
+    ++curr_position.column;
+  }
+  return c;
+}
+
+void Tokenizer::unget() {
+  is.unget();
+  curr_position = last_position;
+}
+
 Token Tokenizer::peek() {
   if (!did_peek) {
     last_token = read_token();
@@ -20,25 +38,44 @@ Token Tokenizer::read_token() {
 
   decltype(is.get()) curr_char;
   do {
-    curr_char = is.get();
+    curr_char = get();
   } while (std::isspace(curr_char));
+  token_position = curr_position;
     
   if (is.eof()) { return Token::eof; }
   if (curr_char == '(') { return Token::lparen; }
   if (curr_char == ')') { return Token::rparen; }
   if (curr_char == '\'') { return Token::quote; }
+  if (curr_char == '"') {
+    symbol_data.clear();
+    for (;;) {
+      curr_char = get();
+      if (is.eof()) {
+	throw std::runtime_error("reached end of input in string");
+      }
+      if (curr_char == '"') break;
+      if (curr_char == '\\') {
+	curr_char = get();
+	if (curr_char == 'n') curr_char = '\n';
+	if (curr_char == 't') curr_char = '\t';
+      }
+      symbol_data += curr_char;
+    }
+    return Token::string;
+  }
 
-  // consume chars until we hit quote, eof, space, lparen or rparen,
-  // accumulating the chars in curr_token
+  // consume chars until we hit quote, double quote, eof, space, lparen
+  // or rparen, accumulating the chars in curr_token
   std::string curr_token{static_cast<char>(curr_char)};
   for (;;) {
-    curr_char = is.get();
+    curr_char = get();
     if (is.eof()
 	|| std::isspace(curr_char)
 	|| curr_char == '('
 	|| curr_char == ')'
-	|| curr_char == '\'') {
-      is.unget();
+	|| curr_char == '\''
+	|| curr_char == '"') {
+      unget();
       break;
     }
     curr_token += curr_char;
@@ -59,6 +96,12 @@ Token Tokenizer::read_token() {
       is_number = true;
   } catch (const std::invalid_argument&) {}
   if (is_number) {
+    // integers that fit in 64 bits are fixnums
+    auto end = curr_token.data() + curr_token.size();
+    auto res = std::from_chars(curr_token.data(), end, fixnum_data);
+    if (res.ec == std::errc{} && res.ptr == end) {
+      return Token::fixnum;
+    }
     return Token::number;
   } else {
     symbol_data = std::move(curr_token);
@@ -71,14 +114,23 @@ Reader::Reader(std::istream& is)
   : t{is} {}
 
 Object Reader::read() {
-  switch (t.read_token()) {
+  auto token = t.read_token();
+  auto position = t.token_position;
+  switch (token) {
   case Token::number:
     return Object{t.number_data};
+  case Token::fixnum:
+    return Object::fixnum(t.fixnum_data);
   case Token::symbol:
     return Object{memory.symbol(t.symbol_data)};
-  case Token::quote:
-    return Object{memory.cons(Constants::quote,
-			      Object{memory.cons(read(), Constants::nil)})};
+  case Token::string:
+    return memory.string(t.symbol_data);
+  case Token::quote: {
+    Object elements[] {Constants::quote, read()};
+    auto quoted = memory.list(elements, 2, Constants::nil);
+    positions[&quoted.car()] = position;
+    return quoted;
+  }
   case Token::lparen:
     break;
   case Token::rparen:
@@ -103,38 +155,57 @@ Object Reader::read() {
   }
 
   // parsing a list
-  auto first = memory.cons(read(), Constants::nil);
-  auto last = first;
-  for(;;) {
-    switch (t.peek()) {
-    case Token::rparen:
+  std::vector<Object> elements;
+  auto tail = Constants::nil;
+  for (;;) {
+    auto token = t.peek();
+    if (token == Token::rparen) {
       t.read_token();
-      return Object{first};
-    case Token::dot:
+      break;
+    }
+    if (token == Token::dot) {
       t.read_token();
-      last->cdr = read();
+      tail = read();
       if (t.read_token() != Token::rparen) {
 	throw std::runtime_error("expected right parentheis");
-      }	
-      return Object{first};
-    default:
+      }
       break;
     }
-    auto cons = memory.cons(read(), Constants::nil);
-    last->cdr = Object{cons};
-    last = cons;
-  }    
+    elements.push_back(read());
+  }
+  auto list = memory.list(elements.data(), elements.size(), tail);
+  positions[&list.car()] = position;
+  return list;
+}
+
+bool Reader::at_end() {
+  return t.peek() == Token::eof;
 }
 
 std::unique_ptr<Form> Parser::parse(const Object& o) {
+  auto form = parse_form(o);
+  if (o.is_cons()) {
+    if (auto it = positions.find(&o.car()); it != positions.end()) {
+      form->position = it->second;
+    }
+  }
+  return form;
+}
+
+std::unique_ptr<Form> Parser::parse_form(const Object& o) {
   if (o.is_number()) {
-    return std::make_unique<NumberForm>(o.as_number());
+    return std::make_unique<NumberForm>(o);
   }
 
   if (o.is_symbol()) {
     return std::make_unique<SymbolForm>(o.as_symbol());
   }
 
+  // strings evaluate to themselves
+  if (o.is_string()) {
+    return std::make_unique<QuoteForm>(o);
+  }
+
   auto& car = o.car();
   if (car == Constants::if_) {
     return Parser::parse_if(o);
@@ -194,6 +265,9 @@ std::unique_ptr<Form> Parser::parse_letrec(const Object& o) {
     bindings.emplace_back(binder.as_symbol(),
 			  std::move(parameter_vector),
 			  Parser::parse(definition));
+    if (auto it = positions.find(&binding.car()); it != positions.end()) {
+      bindings.back().position = it->second;
+    }
   }
   return std::make_unique<LetrecForm>(std::move(bindings), parse(body));
 }
@@ -0,0 +1,803 @@
+#include "peval.hpp"
+
+struct FormCloner : public FormVisitor {
+  std::unique_ptr<Form> res;
+
+  std::unique_ptr<Form> copy(Form& f) {
+    f.accept(*this);
+    res->position = f.position;
+    return std::move(res);
+  }
+
+  void operator()(NumberForm& f) override {
+    res = std::make_unique<NumberForm>(f.number);
+  }
+  void operator()(SymbolForm& f) override {
+    res = std::make_unique<SymbolForm>(f.symbol);
+  }
+  void operator()(IfForm& f) override {
+    auto cond_form = copy(*f.cond_form);
+    auto then_form = copy(*f.then_form);
+    auto else_form = copy(*f.else_form);
+    res = std::make_unique<IfForm>(std::move(cond_form),
+				   std::move(then_form),
+				   std::move(else_form));
+  }
+  void operator()(LetForm& f) override {
+    std::vector<VariableBinding> bindings;
+    for (auto&& binding : f.bindings) {
+      bindings.emplace_back(binding.binder, copy(*binding.definition));
+    }
+    auto body = copy(*f.body);
+    res = std::make_unique<LetForm>(std::move(bindings), std::move(body));
+  }
+  void operator()(LetrecForm& f) override {
+    std::vector<FunctionBinding> bindings;
+    for (auto&& binding : f.bindings) {
+      auto parameters = binding.parameters;
+      bindings.emplace_back(binding.binder, std::move(parameters),
+			    copy(*binding.definition));
+      bindings.back().position = binding.position;
+    }
+    auto body = copy(*f.body);
+    res = std::make_unique<LetrecForm>(std::move(bindings), std::move(body));
+  }
+  void operator()(QuoteForm& f) override {
+    res = std::make_unique<QuoteForm>(f.arg);
+  }
+  void operator()(ApplicationForm& f) override {
+    auto function_form = copy(*f.function_form);
+    std::vector<std::unique_ptr<Form>> arg_forms;
+    for (auto&& arg_form : f.arg_forms) {
+      arg_forms.emplace_back(copy(*arg_form));
+    }
+    res = std::make_unique<ApplicationForm>(std::move(function_form),
+					    std::move(arg_forms));
+  }
+  void operator()(LambdaForm& f) override {
+    auto parameters = f.parameters;
+    auto body = copy(*f.body);
+    res = std::make_unique<LambdaForm>(std::move(parameters), std::move(body));
+  }
+};
+
+std::unique_ptr<Form> clone(Form& f) {
+  return FormCloner{}.copy(f);
+}
+
+struct FormSize : public FormVisitor {
+  int res {0};
+
+  void count(Form& f) {
+    ++res;
+    f.accept(*this);
+  }
+
+  void operator()(NumberForm& f) override {}
+  void operator()(SymbolForm& f) override {}
+  void operator()(IfForm& f) override {
+    count(*f.cond_form);
+    count(*f.then_form);
+    count(*f.else_form);
+  }
+  void operator()(LetForm& f) override {
+    for (auto&& binding : f.bindings) {
+      count(*binding.definition);
+    }
+    count(*f.body);
+  }
+  void operator()(LetrecForm& f) override {
+    for (auto&& binding : f.bindings) {
+      count(*binding.definition);
+    }
+    count(*f.body);
+  }
+  void operator()(QuoteForm& f) override {}
+  void operator()(ApplicationForm& f) override {
+    count(*f.function_form);
+    for (auto&& arg_form : f.arg_forms) {
+      count(*arg_form);
+    }
+  }
+  void operator()(LambdaForm& f) override {
+    count(*f.body);
+  }
+};
+
+int form_size(Form& f) {
+  FormSize counter;
+  counter.count(f);
+  return counter.res;
+}
+
+namespace {
+  std::unordered_set<Symbol> free_variables(Form& f) {
+    FreeVarCollector collector {[](auto&& s) { return false; }};
+    collector.collect(f);
+    return std::move(collector.res);
+  }
+
+  bool occurs_free(Symbol s, Form& f) {
+    return free_variables(f).count(s) > 0;
+  }
+
+  // the literals that are propagated into the scope of their binding;
+  // quoted lists are left alone, every evaluation of a quote builds a
+  // fresh one
+  Form* literal(Form& f) {
+    if (Discriminator<NumberForm>::as(f)) {
+      return &f;
+    }
+    if (auto quote = Discriminator<QuoteForm>::as(f); quote && !quote->arg.is_cons()) {
+      return &f;
+    }
+    return nullptr;
+  }
+
+  // forms whose evaluation can be dropped if the value isn't used
+  bool is_pure(Form& f) {
+    return literal(f)
+      || Discriminator<SymbolForm>::as(f)
+      || Discriminator<QuoteForm>::as(f)
+      || Discriminator<LambdaForm>::as(f);
+  }
+
+  // Renames the free occurrences of a variable, down to where another
+  // binding shadows it.
+  struct Renamer : public FormVisitor {
+    Symbol from;
+    Symbol to;
+
+    Renamer(Symbol from, Symbol to)
+      : from{from}, to{to}
+    {}
+
+    void rename(Form& f) {
+      f.accept(*this);
+    }
+
+    void operator()(NumberForm& f) override {}
+    void operator()(SymbolForm& f) override {
+      if (f.symbol == from) f.symbol = to;
+    }
+    void operator()(IfForm& f) override {
+      rename(*f.cond_form);
+      rename(*f.then_form);
+      rename(*f.else_form);
+    }
+    void operator()(LetForm& f) override {
+      for (auto&& binding : f.bindings) {
+	rename(*binding.definition);
+	if (binding.binder == from) return;
+      }
+      rename(*f.body);
+    }
+    void operator()(LetrecForm& f) override {
+      for (auto&& binding : f.bindings) {
+	if (binding.binder == from) return;
+      }
+      for (auto&& binding : f.bindings) {
+	auto&& parameters = binding.parameters;
+	if (std::find(parameters.begin(), parameters.end(), from) == parameters.end()) {
+	  rename(*binding.definition);
+	}
+      }
+      rename(*f.body);
+    }
+    void operator()(QuoteForm& f) override {}
+    void operator()(ApplicationForm& f) override {
+      rename(*f.function_form);
+      for (auto&& arg_form : f.arg_forms) {
+	rename(*arg_form);
+      }
+    }
+    void operator()(LambdaForm& f) override {
+      if (std::find(f.parameters.begin(), f.parameters.end(), from)
+	  == f.parameters.end()) {
+	rename(*f.body);
+      }
+    }
+  };
+
+  std::unique_ptr<Form> make_let(const std::vector<Symbol>& parameters,
+				 std::vector<std::unique_ptr<Form>>&& arg_forms,
+				 std::unique_ptr<Form>&& body) {
+    std::vector<VariableBinding> bindings;
+    for (std::size_t i = 0; i < parameters.size(); ++i) {
+      bindings.emplace_back(parameters[i], std::move(arg_forms[i]));
+    }
+    return std::make_unique<LetForm>(std::move(bindings), std::move(body));
+  }
+}
+
+std::unique_ptr<Form>
+PartialEvaluator::bind_arguments(std::vector<Symbol> parameters,
+				 std::vector<std::unique_ptr<Form>>&& arg_forms,
+				 std::unique_ptr<Form>&& body) {
+  // the let binds the parameters one after the other, so a parameter
+  // that a later argument refers to would capture that reference: it
+  // is renamed in the body to a symbol no source can refer to
+  for (std::size_t i = 1; i < arg_forms.size(); ++i) {
+    auto fvs = free_variables(*arg_forms[i]);
+    for (std::size_t j = 0; j < i; ++j) {
+      if (!fvs.count(parameters[j])) continue;
+      auto fresh = memory.symbol(std::string{parameters[j]->name()} + " "
+				 + std::to_string(++renamed));
+      Renamer{parameters[j], fresh}.rename(*body);
+      parameters[j] = fresh;
+    }
+  }
+  return make_let(parameters, std::move(arg_forms), std::move(body));
+}
+
+PartialEvaluator::PartialEvaluator(std::function<bool(Symbol)> is_primitive)
+  : is_primitive{is_primitive}
+{
+  foldable[memory.symbol("add")] = &_add;
+  foldable[memory.symbol("sub")] = &_sub;
+  foldable[memory.symbol("mult")] = &_mult;
+  foldable[memory.symbol("div")] = &__div;
+  foldable[memory.symbol("<")] = &_lt;
+  foldable[memory.symbol(">")] = &_gt;
+  foldable[memory.symbol("<=")] = &_le;
+  foldable[memory.symbol(">=")] = &_ge;
+  foldable[memory.symbol("=")] = &_num_eq;
+}
+
+auto PartialEvaluator::find_binding(Symbol s) -> const Binding* {
+  for (auto it = bindings.rbegin(); it != bindings.rend(); ++it) {
+    if (it->symbol == s) return &*it;
+  }
+  return nullptr;
+}
+
+auto PartialEvaluator::find_inlinable(Symbol s) -> const Inlinable* {
+  for (auto it = inlinables.rbegin(); it != inlinables.rend(); ++it) {
+    if (it->binding->binder != s) continue;
+    // neither the function nor its free variables may have been
+    // rebound between the letrec and here
+    for (auto i = it->depth; i < bindings.size(); ++i) {
+      if (bindings[i].symbol == s || it->fvs.count(bindings[i].symbol)) {
+	return nullptr;
+      }
+    }
+    return &*it;
+  }
+  return nullptr;
+}
+
+std::unique_ptr<Form> PartialEvaluator::evaluate(std::unique_ptr<Form>&& f) {
+  // the visitor takes ownership of the form from current and leaves
+  // the simplified form in res
+  current = std::move(f);
+  current->accept(*this);
+  return std::move(res);
+}
+
+void PartialEvaluator::operator()(NumberForm& f) {
+  res = std::move(current);
+}
+
+void PartialEvaluator::operator()(QuoteForm& f) {
+  res = std::move(current);
+}
+
+void PartialEvaluator::operator()(SymbolForm& f) {
+  auto self = std::move(current);
+  auto binding = find_binding(f.symbol);
+  if (binding && binding->constant) {
+    res = clone(*binding->constant);
+    res->position = f.position;
+    return;
+  }
+  res = std::move(self);
+}
+
+void PartialEvaluator::operator()(IfForm& f) {
+  auto self = std::move(current);
+  f.cond_form = evaluate(std::move(f.cond_form));
+  if (literal(*f.cond_form)) {
+    auto quote = Discriminator<QuoteForm>::as(*f.cond_form);
+    auto taken = quote && quote->arg.is_nil() ? &f.else_form : &f.then_form;
+    res = evaluate(std::move(*taken));
+    return;
+  }
+  f.then_form = evaluate(std::move(f.then_form));
+  f.else_form = evaluate(std::move(f.else_form));
+  res = std::move(self);
+}
+
+void PartialEvaluator::operator()(LetForm& f) {
+  auto self = std::move(current);
+  auto depth = bindings.size();
+  for (auto&& binding : f.bindings) {
+    binding.definition = evaluate(std::move(binding.definition));
+    bindings.push_back({binding.binder, literal(*binding.definition)});
+  }
+  f.body = evaluate(std::move(f.body));
+  bindings.resize(depth);
+
+  // drop the unused bindings, going backwards so that bindings only
+  // used by dropped ones go as well
+  auto&& is_used = [&](std::size_t i) {
+    auto binder = f.bindings[i].binder;
+    for (auto j = i+1; j < f.bindings.size(); ++j) {
+      if (occurs_free(binder, *f.bindings[j].definition)) return true;
+      if (f.bindings[j].binder == binder) return false;
+    }
+    return occurs_free(binder, *f.body);
+  };
+  for (auto i = f.bindings.size(); i-- > 0;) {
+    if (is_pure(*f.bindings[i].definition) && !is_used(i)) {
+      f.bindings.erase(f.bindings.begin()+i);
+    }
+  }
+  res = f.bindings.empty() ? std::move(f.body) : std::move(self);
+}
+
+void PartialEvaluator::operator()(LetrecForm& f) {
+  auto self = std::move(current);
+  auto depth = bindings.size();
+  for (auto&& binding : f.bindings) {
+    bindings.push_back({binding.binder, nullptr});
+  }
+  for (auto&& binding : f.bindings) {
+    for (auto&& parameter : binding.parameters) {
+      bindings.push_back({parameter, nullptr});
+    }
+    binding.definition = evaluate(std::move(binding.definition));
+    bindings.resize(depth + f.bindings.size());
+  }
+
+  auto inlinables_depth = inlinables.size();
+  for (auto&& binding : f.bindings) {
+    if (form_size(*binding.definition) > inline_limit) continue;
+    auto fvs = free_variables(*binding.definition);
+    for (auto&& parameter : binding.parameters) {
+      fvs.erase(parameter);
+    }
+    auto&& calls_letrec = [&](auto&& other) { return fvs.count(other.binder) > 0; };
+    if (std::any_of(f.bindings.begin(), f.bindings.end(), calls_letrec)) continue;
+    inlinables.push_back({&binding, bindings.size(), std::move(fvs)});
+  }
+  f.body = evaluate(std::move(f.body));
+  inlinables.resize(inlinables_depth);
+  bindings.resize(depth);
+
+  // drop the functions nobody calls anymore
+  auto&& is_used = [&](std::size_t i) {
+    auto binder = f.bindings[i].binder;
+    for (std::size_t j = 0; j < f.bindings.size(); ++j) {
+      auto&& parameters = f.bindings[j].parameters;
+      if (j != i
+	  && std::find(parameters.begin(), parameters.end(), binder) == parameters.end()
+	  && occurs_free(binder, *f.bindings[j].definition)) {
+	return true;
+      }
+    }
+    return occurs_free(binder, *f.body);
+  };
+  for (auto i = f.bindings.size(); i-- > 0;) {
+    if (!is_used(i)) {
+      f.bindings.erase(f.bindings.begin()+i);
+    }
+  }
+  res = f.bindings.empty() ? std::move(f.body) : std::move(self);
+}
+
+void PartialEvaluator::operator()(ApplicationForm& f) {
+  auto self = std::move(current);
+
+  // ((lambda (x ...) body) arg ...) => (let ((x arg) ...) body)
+  if (auto lambda = Discriminator<LambdaForm>::as(*f.function_form);
+      lambda
+      && lambda->parameters.size() == f.arg_forms.size()) {
+    auto let = bind_arguments(lambda->parameters, std::move(f.arg_forms),
+			      std::move(lambda->body));
+    let->position = f.position;
+    res = evaluate(std::move(let));
+    return;
+  }
+
+  for (auto&& arg_form : f.arg_forms) {
+    arg_form = evaluate(std::move(arg_form));
+  }
+  auto symbol_form = Discriminator<SymbolForm>::as(*f.function_form);
+  if (!symbol_form) {
+    f.function_form = evaluate(std::move(f.function_form));
+    res = std::move(self);
+    return;
+  }
+  auto s = symbol_form->symbol;
+
+  // (f arg ...) => (let ((parameter arg) ...) body-of-f)
+  if (auto inlinable = find_inlinable(s);
+      inlinable
+      && inlinable->binding->parameters.size() == f.arg_forms.size()) {
+    auto let = bind_arguments(inlinable->binding->parameters, std::move(f.arg_forms),
+			      clone(*inlinable->binding->definition));
+    let->position = f.position;
+    res = evaluate(std::move(let));
+    return;
+  }
+
+  // primitives applied to two numbers
+  auto lhs = f.arg_forms.size() == 2 ? Discriminator<NumberForm>::as(*f.arg_forms[0]) : nullptr;
+  auto rhs = f.arg_forms.size() == 2 ? Discriminator<NumberForm>::as(*f.arg_forms[1]) : nullptr;
+  if (lhs && rhs && !find_binding(s) && is_primitive(s)) {
+    if (auto it = foldable.find(s); it != foldable.end()) {
+      // a number, or t or nil for the comparisons
+      auto value = it->second(lhs->number, rhs->number);
+      if (value.is_number()) {
+	res = std::make_unique<NumberForm>(value);
+      } else {
+	res = std::make_unique<QuoteForm>(value);
+      }
+      res->position = f.position;
+      return;
+    }
+  }
+  res = std::move(self);
+}
+
+void PartialEvaluator::operator()(LambdaForm& f) {
+  auto self = std::move(current);
+  auto depth = bindings.size();
+  for (auto&& parameter : f.parameters) {
+    bindings.push_back({parameter, nullptr});
+  }
+  f.body = evaluate(std::move(f.body));
+  bindings.resize(depth);
+  res = std::move(self);
+}
+
+namespace {
+  // Checks that a letrec function's parameter is only ever called, or
+  // passed at the same position to the function's recursive calls,
+  // and that neither is rebound inside the function. Also notes if the
+  // function calls itself from within a lambda: the compiler doesn't
+  // pass free variables to such calls, so the function can't be
+  // cloned for a lambda that has any.
+  struct ParameterUse : public FormVisitor {
+    Symbol function;
+    std::size_t index;
+    Symbol parameter;
+    bool ok {true};
+    bool called {false};
+    bool called_in_lambda {false};
+    int lambda_depth {0};
+
+    ParameterUse(Symbol function, std::size_t index, Symbol parameter)
+      : function{function}, index{index}, parameter{parameter}
+    {}
+
+    void check(Form& f) {
+      f.accept(*this);
+    }
+    void bind(Symbol s) {
+      if (s == function || s == parameter) ok = false;
+    }
+
+    void operator()(NumberForm& f) override {}
+    void operator()(SymbolForm& f) override {
+      if (f.symbol == parameter) ok = false;
+    }
+    void operator()(IfForm& f) override {
+      check(*f.cond_form);
+      check(*f.then_form);
+      check(*f.else_form);
+    }
+    void operator()(LetForm& f) override {
+      for (auto&& binding : f.bindings) {
+	check(*binding.definition);
+	bind(binding.binder);
+      }
+      check(*f.body);
+    }
+    void operator()(LetrecForm& f) override {
+      for (auto&& binding : f.bindings) {
+	bind(binding.binder);
+	for (auto&& parameter : binding.parameters) {
+	  bind(parameter);
+	}
+	check(*binding.definition);
+      }
+      check(*f.body);
+    }
+    void operator()(QuoteForm& f) override {}
+    void operator()(ApplicationForm& f) override {
+      auto head = Discriminator<SymbolForm>::as(*f.function_form);
+      if (head && head->symbol == function) {
+	if (lambda_depth > 0) called_in_lambda = true;
+	auto arg = f.arg_forms.size() > index
+	  ? Discriminator<SymbolForm>::as(*f.arg_forms[index])
+	  : nullptr;
+	if (!arg || arg->symbol != parameter) ok = false;
+	for (std::size_t i = 0; i < f.arg_forms.size(); ++i) {
+	  if (i != index) check(*f.arg_forms[i]);
+	}
+	return;
+      }
+      if (head && head->symbol == parameter) {
+	called = true;
+      } else {
+	check(*f.function_form);
+      }
+      for (auto&& arg_form : f.arg_forms) {
+	check(*arg_form);
+      }
+    }
+    void operator()(LambdaForm& f) override {
+      for (auto&& parameter : f.parameters) {
+	bind(parameter);
+      }
+      ++lambda_depth;
+      check(*f.body);
+      --lambda_depth;
+    }
+  };
+
+  struct BinderCollector : public FormVisitor {
+    std::unordered_set<Symbol> res;
+
+    void collect(Form& f) {
+      f.accept(*this);
+    }
+
+    void operator()(NumberForm& f) override {}
+    void operator()(SymbolForm& f) override {}
+    void operator()(IfForm& f) override {
+      collect(*f.cond_form);
+      collect(*f.then_form);
+      collect(*f.else_form);
+    }
+    void operator()(LetForm& f) override {
+      for (auto&& binding : f.bindings) {
+	res.insert(binding.binder);
+	collect(*binding.definition);
+      }
+      collect(*f.body);
+    }
+    void operator()(LetrecForm& f) override {
+      for (auto&& binding : f.bindings) {
+	res.insert(binding.binder);
+	res.insert(binding.parameters.begin(), binding.parameters.end());
+	collect(*binding.definition);
+      }
+      collect(*f.body);
+    }
+    void operator()(QuoteForm& f) override {}
+    void operator()(ApplicationForm& f) override {
+      collect(*f.function_form);
+      for (auto&& arg_form : f.arg_forms) {
+	collect(*arg_form);
+      }
+    }
+    void operator()(LambdaForm& f) override {
+      res.insert(f.parameters.begin(), f.parameters.end());
+      collect(*f.body);
+    }
+  };
+
+  // Rewrites the copy of a function checked by ParameterUse into its
+  // specialization for a lambda.
+  struct Specialization : public FormVisitor {
+    Symbol function;
+    std::size_t index;
+    Symbol parameter;
+    LambdaForm& lambda;
+    Symbol specialized;
+
+    Specialization(Symbol function, std::size_t index, Symbol parameter,
+		   LambdaForm& lambda, Symbol specialized)
+      : function{function}, index{index}, parameter{parameter},
+	lambda{lambda}, specialized{specialized}
+    {}
+
+    void rewrite(Form& f) {
+      f.accept(*this);
+    }
+
+    void operator()(NumberForm& f) override {}
+    void operator()(SymbolForm& f) override {}
+    void operator()(IfForm& f) override {
+      rewrite(*f.cond_form);
+      rewrite(*f.then_form);
+      rewrite(*f.else_form);
+    }
+    void operator()(LetForm& f) override {
+      for (auto&& binding : f.bindings) {
+	rewrite(*binding.definition);
+      }
+      rewrite(*f.body);
+    }
+    void operator()(LetrecForm& f) override {
+      for (auto&& binding : f.bindings) {
+	rewrite(*binding.definition);
+      }
+      rewrite(*f.body);
+    }
+    void operator()(QuoteForm& f) override {}
+    void operator()(ApplicationForm& f) override {
+      auto head = Discriminator<SymbolForm>::as(*f.function_form);
+      auto position = f.function_form->position;
+      if (head && head->symbol == parameter) {
+	f.function_form = clone(lambda);
+	f.function_form->position = position;
+      } else if (head && head->symbol == function) {
+	f.function_form = std::make_unique<SymbolForm>(specialized);
+	f.function_form->position = position;
+	f.arg_forms.erase(f.arg_forms.begin() + index);
+      } else {
+	rewrite(*f.function_form);
+      }
+      for (auto&& arg_form : f.arg_forms) {
+	rewrite(*arg_form);
+      }
+    }
+    void operator()(LambdaForm& f) override {
+      rewrite(*f.body);
+    }
+  };
+}
+
+auto Specializer::find_scope(Symbol s) -> const Scope* {
+  for (auto it = scopes.rbegin(); it != scopes.rend(); ++it) {
+    if (it->symbol == s) return &*it;
+  }
+  return nullptr;
+}
+
+Symbol Specializer::specialize(Letrec& letrec, std::size_t i, LambdaForm& lambda,
+			       std::string_view lambda_name) {
+  auto&& binding = letrec.form->bindings[i];
+  auto key = std::make_pair(&binding, &lambda);
+  if (auto it = letrec.names.find(key); it != letrec.names.end()) {
+    return it->second;
+  }
+
+  // function<lambda>, made unique within the letrec
+  auto&& is_taken = [&](Symbol s) {
+    auto&& same = [&](auto&& other) { return other.binder == s; };
+    return std::any_of(letrec.form->bindings.begin(), letrec.form->bindings.end(), same)
+      || std::any_of(letrec.specializations.begin(), letrec.specializations.end(), same);
+  };
+  std::string base {binding.binder->name()};
+  base += "<" + std::string{lambda_name} + ">";
+  auto name = memory.symbol(base);
+  for (int n = 2; is_taken(name); ++n) {
+    name = memory.symbol(base + std::to_string(n));
+  }
+
+  auto index = letrec.parameters[i];
+  auto parameters = binding.parameters;
+  auto parameter = parameters[index];
+  parameters.erase(parameters.begin() + index);
+  auto definition = clone(*binding.definition);
+  Specialization{binding.binder, static_cast<std::size_t>(index), parameter,
+		 lambda, name}.rewrite(*definition);
+  letrec.specializations.emplace_back(name, std::move(parameters),
+				      std::move(definition));
+  letrec.specializations.back().position = binding.position;
+  letrec.names[key] = name;
+  return name;
+}
+
+void Specializer::operator()(IfForm& f) {
+  specialize(*f.cond_form);
+  specialize(*f.then_form);
+  specialize(*f.else_form);
+}
+
+void Specializer::operator()(LetForm& f) {
+  auto depth = scopes.size();
+  for (auto&& binding : f.bindings) {
+    specialize(*binding.definition);
+    scopes.push_back({binding.binder, Discriminator<LambdaForm>::as(*binding.definition)});
+  }
+  specialize(*f.body);
+  scopes.resize(depth);
+}
+
+void Specializer::operator()(LetrecForm& f) {
+  Letrec letrec {&f};
+  auto depth = scopes.size();
+  for (std::size_t i = 0; i < f.bindings.size(); ++i) {
+    scopes.push_back({f.bindings[i].binder, nullptr, &letrec, i});
+  }
+  for (auto&& binding : f.bindings) {
+    for (auto&& parameter : binding.parameters) {
+      scopes.push_back({parameter});
+    }
+    specialize(*binding.definition);
+    scopes.resize(depth + f.bindings.size());
+  }
+
+  for (auto&& binding : f.bindings) {
+    int index = -1;
+    bool called_in_lambda = false;
+    for (std::size_t i = 0; i < binding.parameters.size() && index < 0; ++i) {
+      ParameterUse use {binding.binder, i, binding.parameters[i]};
+      use.check(*binding.definition);
+      if (use.ok && use.called) {
+	index = i;
+	called_in_lambda = use.called_in_lambda;
+      }
+    }
+    letrec.parameters.push_back(index);
+    letrec.called_in_lambda.push_back(called_in_lambda);
+    BinderCollector binders;
+    binders.collect(*binding.definition);
+    binders.res.insert(binding.parameters.begin(), binding.parameters.end());
+    letrec.binders.emplace_back(std::move(binders.res));
+  }
+
+  letrec.depth = scopes.size();
+  letrec.in_body = true;
+  specialize(*f.body);
+  scopes.resize(depth);
+
+  for (auto&& specialization : letrec.specializations) {
+    f.bindings.emplace_back(std::move(specialization));
+  }
+}
+
+void Specializer::operator()(ApplicationForm& f) {
+  for (auto&& arg_form : f.arg_forms) {
+    specialize(*arg_form);
+  }
+  auto head = Discriminator<SymbolForm>::as(*f.function_form);
+  if (!head) {
+    specialize(*f.function_form);
+    return;
+  }
+
+  // is this a call from a letrec's body to one of its functions?
+  auto function = find_scope(head->symbol);
+  if (!function || !function->letrec || !function->letrec->in_body) return;
+  auto&& letrec = *function->letrec;
+  auto i = function->binding;
+  auto index = letrec.parameters[i];
+  if (index < 0 || letrec.form->bindings[i].parameters.size() != f.arg_forms.size()) {
+    return;
+  }
+
+  // with a lambda, literally or through a variable bound to one
+  auto&& arg_form = *f.arg_forms[index];
+  auto lambda = Discriminator<LambdaForm>::as(arg_form);
+  std::string_view lambda_name {"lambda"};
+  if (auto symbol_form = Discriminator<SymbolForm>::as(arg_form)) {
+    auto scope = find_scope(symbol_form->symbol);
+    lambda = scope ? scope->lambda : nullptr;
+    lambda_name = symbol_form->symbol->name();
+  }
+  if (!lambda) return;
+
+  // the lambda's free variables have to mean the same within the
+  // function as they do here; the local ones become parameters of the
+  // clone
+  FreeVarCollector collector {[](auto&& s) { return false; }};
+  collector.collect(*lambda);
+  for (auto&& fv : collector.res) {
+    if (letrec.binders[i].count(fv)) return;
+    if (letrec.called_in_lambda[i] && find_scope(fv)) return;
+    for (auto j = letrec.depth; j < scopes.size(); ++j) {
+      if (scopes[j].symbol == fv) return;
+    }
+  }
+
+  auto name = specialize(letrec, i, *lambda, lambda_name);
+  auto position = f.function_form->position;
+  f.function_form = std::make_unique<SymbolForm>(name);
+  f.function_form->position = position;
+  f.arg_forms.erase(f.arg_forms.begin() + index);
+}
+
+void Specializer::operator()(LambdaForm& f) {
+  auto depth = scopes.size();
+  for (auto&& parameter : f.parameters) {
+    scopes.push_back({parameter});
+  }
+  specialize(*f.body);
+  scopes.resize(depth);
+}
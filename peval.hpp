@@ -0,0 +1,127 @@
+#pragma once
+#include "decls.hpp"
+#include <map>
+
+// deep copy of a form
+std::unique_ptr<Form> clone(Form& f);
+
+// number of forms in a form, as a measure for inlining
+int form_size(Form& f);
+
+// Simplifies a parsed form before it is compiled, working on what the
+// closures hide from LLVM:
+// - applications of a lambda form become a let,
+// - lets binding a literal are propagated into their body, and unused
+//   bindings without side effects are dropped,
+// - arithmetic and comparisons of literals are folded, as are ifs on
+//   a literal,
+// - small letrec functions that don't call any function of their own
+//   letrec are inlined into its body.
+class PartialEvaluator : public FormVisitor {
+private:
+  // whether a symbol that isn't bound locally names a runtime primitive
+  std::function<bool(Symbol)> is_primitive;
+  // arithmetic and comparisons are folded by calling the runtime's
+  // functions, so fixnum overflow and the like work out the same
+  std::unordered_map<Symbol, Object(*)(Object, Object)> foldable {};
+
+  // the local variables in scope, innermost last; constant is the
+  // literal the variable is bound to, if any
+  struct Binding {
+    Symbol symbol;
+    Form* constant;
+  };
+  std::vector<Binding> bindings {};
+  const Binding* find_binding(Symbol s);
+
+  // letrec functions that can be inlined in the body of their letrec,
+  // depth is the number of bindings in scope there
+  struct Inlinable {
+    FunctionBinding* binding;
+    std::size_t depth;
+    std::unordered_set<Symbol> fvs;
+  };
+  std::vector<Inlinable> inlinables {};
+  const Inlinable* find_inlinable(Symbol s);
+
+  // (let ((parameter arg) ...) body), renaming parameters of body as
+  // needed to keep the arguments' variables from being captured
+  std::unique_ptr<Form> bind_arguments(std::vector<Symbol> parameters,
+				       std::vector<std::unique_ptr<Form>>&& arg_forms,
+				       std::unique_ptr<Form>&& body);
+  // number of parameters renamed so far, to make fresh names from
+  std::size_t renamed {0};
+
+  std::unique_ptr<Form> current;
+  std::unique_ptr<Form> res;
+
+public:
+  // largest letrec function (see form_size) that gets inlined
+  static constexpr int inline_limit = 24;
+
+  PartialEvaluator(std::function<bool(Symbol)> is_primitive);
+  std::unique_ptr<Form> evaluate(std::unique_ptr<Form>&& f);
+
+  void operator()(NumberForm& f) override;
+  void operator()(SymbolForm& f) override;
+  void operator()(IfForm& f) override;
+  void operator()(LetForm& f) override;
+  void operator()(LetrecForm& f) override;
+  void operator()(QuoteForm& f) override;
+  void operator()(ApplicationForm& f) override;
+  void operator()(LambdaForm& f) override;
+};
+
+// Clones a letrec function for a lambda passed to it from the letrec's
+// body, if the function only calls that parameter and passes it
+// unchanged to its recursive calls. In the clone, the calls of the
+// parameter are applications of the lambda form itself, which the
+// partial evaluator turns into lets, so e.g. (map square lst) becomes
+// a call of map<square>, a first-order loop. Runs before the partial
+// evaluator, which drops the originals if nothing calls them anymore.
+class Specializer : public FormVisitor {
+private:
+  struct Letrec {
+    LetrecForm* form;
+    // number of scope entries in the letrec's body
+    std::size_t depth {0};
+    bool in_body {false};
+    // for each binding the parameter it can be specialized on, or -1,
+    // every variable bound within it, and whether it calls itself from
+    // within a lambda
+    std::vector<int> parameters {};
+    std::vector<std::unordered_set<Symbol>> binders {};
+    std::vector<bool> called_in_lambda {};
+    // the clones made so far, by the function and lambda
+    std::vector<FunctionBinding> specializations {};
+    std::map<std::pair<FunctionBinding*, LambdaForm*>, Symbol> names {};
+  };
+
+  // the variables in scope, innermost last; lambda is set for variables
+  // bound to a lambda form, letrec for letrec functions
+  struct Scope {
+    Symbol symbol;
+    LambdaForm* lambda {nullptr};
+    Letrec* letrec {nullptr};
+    std::size_t binding {0};
+  };
+  std::vector<Scope> scopes {};
+  const Scope* find_scope(Symbol s);
+
+  Symbol specialize(Letrec& letrec, std::size_t i, LambdaForm& lambda,
+		    std::string_view lambda_name);
+
+public:
+  void specialize(Form& f) {
+    f.accept(*this);
+  }
+
+  void operator()(NumberForm& f) override {}
+  void operator()(SymbolForm& f) override {}
+  void operator()(IfForm& f) override;
+  void operator()(LetForm& f) override;
+  void operator()(LetrecForm& f) override;
+  void operator()(QuoteForm& f) override {}
+  void operator()(ApplicationForm& f) override;
+  void operator()(LambdaForm& f) override;
+};
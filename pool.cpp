@@ -0,0 +1,108 @@
+#include "decls.hpp"
+
+ThreadPool::ThreadPool(std::size_t n_workers) {
+  for (std::size_t i = 0; i < n_workers; ++i) {
+    workers.push_back(std::make_unique<Worker>());
+  }
+  for (std::size_t i = 0; i < n_workers; ++i) {
+    threads.emplace_back([this, i]() { work(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock{sleep_mutex};
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto&& thread : threads) {
+    thread.join();
+  }
+}
+
+ThreadPool& ThreadPool::instance() {
+  static ThreadPool pool {std::max(1u, std::thread::hardware_concurrency())};
+  return pool;
+}
+
+bool ThreadPool::pop(std::size_t i, std::function<void()>& task) {
+  auto&& worker = *workers[i];
+  std::lock_guard lock{worker.mutex};
+  if (worker.tasks.empty()) return false;
+  task = std::move(worker.tasks.back());
+  worker.tasks.pop_back();
+  --queued;
+  return true;
+}
+
+bool ThreadPool::steal(std::size_t i, std::function<void()>& task) {
+  // try everyone else, starting with the neighbour
+  for (std::size_t k = 1; k < workers.size(); ++k) {
+    auto&& victim = *workers[(i + k) % workers.size()];
+    std::lock_guard lock{victim.mutex};
+    if (victim.tasks.empty()) continue;
+    task = std::move(victim.tasks.front());
+    victim.tasks.pop_front();
+    --queued;
+    return true;
+  }
+  return false;
+}
+
+void ThreadPool::work(std::size_t i) {
+  std::function<void()> task;
+  for (;;) {
+    if (pop(i, task) || steal(i, task)) {
+      task();
+      continue;
+    }
+    std::unique_lock lock{sleep_mutex};
+    wake.wait(lock, [&]() { return stopping || queued > 0; });
+    if (stopping) return;
+  }
+}
+
+void ThreadPool::run(std::vector<std::function<void()>>&& tasks) {
+  // the tasks of the batch not done yet, and the first error raised by
+  // one of them, rethrown once the batch is done
+  std::size_t remaining = tasks.size();
+  std::exception_ptr error;
+  std::mutex done_mutex;
+  std::condition_variable done;
+  for (auto&& task : tasks) {
+    auto i = next_worker++ % workers.size();
+    auto&& worker = *workers[i];
+    std::lock_guard lock{worker.mutex};
+    worker.tasks.emplace_back([&, task = std::move(task)]() {
+      std::exception_ptr task_error;
+      try {
+	task();
+      } catch (...) {
+	task_error = std::current_exception();
+      }
+      // notified under the lock, as done goes away as soon as run
+      // sees the batch is done
+      std::lock_guard lock{done_mutex};
+      if (task_error && !error) error = task_error;
+      if (--remaining == 0) done.notify_all();
+    });
+    ++queued;
+  }
+  {
+    // taking the lock makes sure no worker misses the wakeup between
+    // checking queued and going to sleep
+    std::lock_guard lock{sleep_mutex};
+  }
+  wake.notify_all();
+
+  // help out while there is anything left to take, then sleep until
+  // the tasks of the batch that others took are done
+  std::function<void()> task;
+  auto start = next_worker.load() % workers.size();
+  while (pop(start, task) || steal(start, task)) {
+    task();
+  }
+  std::unique_lock lock{done_mutex};
+  done.wait(lock, [&]() { return remaining == 0; });
+  if (error) std::rethrow_exception(error);
+}
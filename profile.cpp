@@ -0,0 +1,105 @@
+#include <fstream>
+#include <sstream>
+#include "profile.hpp"
+
+std::uint64_t* Profile::counter(const std::string& key) {
+  counters.emplace_back(key, 0);
+  return &counters.back().second;
+}
+
+auto Profile::call_site(const std::string& key) -> CallSite* {
+  call_sites.emplace_back(std::piecewise_construct,
+			  std::forward_as_tuple(key), std::forward_as_tuple());
+  return &call_sites.back().second;
+}
+
+void Profile::name_function(void* code, const std::string& name) {
+  function_names[code] = name;
+}
+
+// the same key can have several counters, e.g. for an if that the
+// partial evaluator duplicated, which add up
+void Profile::collect() {
+  for (auto&& [key, count] : counters) {
+    counts[key] += __atomic_load_n(&count, __ATOMIC_RELAXED);
+  }
+  for (auto&& [key, site] : call_sites) {
+    std::lock_guard lock{site.mutex};
+    for (auto&& [code, count] : site.targets) {
+      // closures of code that isn't an instrumented lambda can't be
+      // promoted anyway
+      if (auto it = function_names.find(code); it != function_names.end()) {
+	calls[key][it->second] += count;
+      }
+    }
+  }
+}
+
+// One line per count: "count <n> <key>" or "call <n> <target> <key>",
+// with the key last as it contains spaces.
+void Profile::write(const std::string& path) {
+  collect();
+  std::ofstream os {path};
+  if (!os) throw std::runtime_error("can't write profile " + path);
+  for (auto&& [key, count] : counts) {
+    os << "count " << count << " " << key << "\n";
+  }
+  for (auto&& [key, targets] : calls) {
+    for (auto&& [target, count] : targets) {
+      os << "call " << count << " " << target << " " << key << "\n";
+    }
+  }
+}
+
+void Profile::read(const std::string& path) {
+  std::ifstream is {path};
+  if (!is) throw std::runtime_error("can't read profile " + path);
+  std::string line;
+  while (std::getline(is, line)) {
+    if (line.empty()) continue;
+    std::istringstream ls {line};
+    std::string kind, target, key;
+    std::uint64_t count;
+    if (!(ls >> kind >> count) || (kind == "call" && !(ls >> target))) {
+      throw std::runtime_error("invalid profile " + path);
+    }
+    std::getline(ls >> std::ws, key);
+    if (kind == "count") {
+      counts[key] += count;
+    } else if (kind == "call") {
+      calls[key][target] += count;
+    } else {
+      throw std::runtime_error("invalid profile " + path);
+    }
+  }
+}
+
+std::optional<std::uint64_t> Profile::count(const std::string& key) const {
+  auto it = counts.find(key);
+  if (it == counts.end()) return std::nullopt;
+  return it->second;
+}
+
+auto Profile::dominant_target(const std::string& key, double share) const
+  -> std::optional<Target> {
+  auto it = calls.find(key);
+  if (it == calls.end()) return std::nullopt;
+  Target best {"", 0, 0};
+  for (auto&& [target, count] : it->second) {
+    best.total += count;
+    if (count > best.count) {
+      best.name = target;
+      best.count = count;
+    }
+  }
+  if (best.count == 0 || best.count < share * best.total) return std::nullopt;
+  return best;
+}
+
+extern "C" {
+  void _profile_call(Profile::CallSite* site, Object closure) {
+    if (!closure.is_closure()) return;
+    std::lock_guard lock{site->mutex};
+    ++site->targets[closure.as_closure()->code];
+  }
+}
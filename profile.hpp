@@ -0,0 +1,59 @@
+#pragma once
+#include "decls.hpp"
+#include <map>
+#include <optional>
+
+// Counts for profile-guided optimization. A run with -profile-generate
+// counts how often each function is entered, which way each if goes
+// and which lambdas each closure call site calls, and writes the
+// counts to a file at exit; a run with -profile-use reads them back.
+// Sites are keyed by source position and functions by name, so a
+// profile stays valid until the program changes.
+class Profile {
+public:
+  // the closures called from a call site, by code address
+  struct CallSite {
+    std::mutex mutex {};
+    std::unordered_map<void*, std::uint64_t> targets {};
+  };
+private:
+  // the instrumented code increments the counters directly, so they
+  // must not move
+  std::deque<std::pair<std::string, std::uint64_t>> counters {};
+  std::deque<std::pair<std::string, CallSite>> call_sites {};
+  std::unordered_map<void*, std::string> function_names {};
+
+  // read from a file, or summed up from the above by write
+  std::map<std::string, std::uint64_t> counts {};
+  std::map<std::string, std::map<std::string, std::uint64_t>> calls {};
+  void collect();
+
+public:
+  // for instrumentation: a new counter or call site for a key
+  std::uint64_t* counter(const std::string& key);
+  CallSite* call_site(const std::string& key);
+  // the name of a lambda of the instrumented code, by its address
+  void name_function(void* code, const std::string& name);
+  void write(const std::string& path);
+
+  void read(const std::string& path);
+  std::optional<std::uint64_t> count(const std::string& key) const;
+  // the lambda that a call site calls most of the time, if there is
+  // one that takes at least the given share of the calls
+  struct Target {
+    std::string name;
+    std::uint64_t count;
+    std::uint64_t total;
+  };
+  std::optional<Target> dominant_target(const std::string& key,
+					double share) const;
+  // every count read, for the profile summary
+  const std::map<std::string, std::uint64_t>& all_counts() const {
+    return counts;
+  }
+};
+
+extern "C" {
+  // counts a closure call from an instrumented call site
+  void _profile_call(Profile::CallSite* site, Object closure);
+}
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Compiles programs from kale-gen at growing sizes and reports how the
+# time of each phase grows with the size, flagging the phases that grow
+# faster than linearly. Usage: scale.sh [shape...]; KALE and KALE_GEN
+# override where the binaries are.
+KALE=${KALE:-./kale}
+KALE_GEN=${KALE_GEN:-./kale-gen}
+# a phase is flagged if it grows at least like size^limit
+limit=1.5
+# and takes at least this long at the largest size, below which the
+# timings are mostly noise
+floor_ms=5
+
+shapes=${*:-letrec lambda let wide quote}
+
+# the smallest size for a shape; every shape is compiled at this size
+# and at 2, 4 and 8 times it
+base_size() {
+  case $1 in
+    quote) echo 1000 ;;
+    *) echo 125 ;;
+  esac
+}
+
+# the code a phase of a shape mostly spends its time in
+suspect() {
+  case $1/$2 in
+    */"free vars") echo "FreeVarCollector" ;;
+    */inject) echo "ApplicationInjector" ;;
+    let/ir|lambda/ir) echo "ScopeStack::get" ;;
+    quote/ir) echo "Compiler::operator()(QuoteForm&)" ;;
+    */simplify) echo "Specializer, PartialEvaluator" ;;
+    */link) echo "LLVM code generation" ;;
+    *) echo "" ;;
+  esac
+}
+
+status=0
+for shape in $shapes; do
+  n=$(base_size $shape)
+  times=$(mktemp)
+  for size in $n $((2*n)) $((4*n)) $((8*n)); do
+    # -time reports lines of "phase  milliseconds ms"
+    "$KALE_GEN" $shape $size | "$KALE" -time 2>&1 >/dev/null \
+      | awk -v size=$size '$NF == "ms" && $1 != "startup" {
+	  name = $1; for (i = 2; i < NF - 1; ++i) name = name " " $i
+	  print size "\t" name "\t" $(NF - 1) }' >> "$times"
+  done
+  echo "== $shape, sizes $n to $((8*n))"
+  # the exponent of the growth from the smallest to the largest size
+  report=$(awk -F'\t' -v limit=$limit -v floor=$floor_ms '
+    !($2 in first) { first[$2] = $3; order[++phases] = $2 }
+    { last[$2] = $3 }
+    END {
+      for (i = 1; i <= phases; ++i) {
+	p = order[i]
+	e = first[p] > 0 ? log(last[p] / first[p]) / log(8) : 0
+	flag = e >= limit && last[p] >= floor ? "  superlinear" : ""
+	printf "%-10s %10.3f ms %10.3f ms  size^%.2f%s\n", p, first[p], last[p], e, flag
+      }
+    }' "$times")
+  echo "$report" | while IFS= read -r line; do
+    case $line in
+      *superlinear)
+	phase=$(echo "$line" | cut -c1-10 | sed 's/ *$//')
+	echo "$line in $(suspect $shape "$phase")" ;;
+      *) echo "$line" ;;
+    esac
+  done
+  case $report in *superlinear*) status=1 ;; esac
+  rm -f "$times"
+done
+exit $status
@@ -0,0 +1,158 @@
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <stdexcept>
+#include <stdio_ext.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "decls.hpp"
+#include "server.hpp"
+
+namespace {
+  [[noreturn]] void system_error(const std::string& what) {
+    throw std::runtime_error(what + ": " + std::strerror(errno));
+  }
+
+  sockaddr_un socket_address(const std::string& path) {
+    sockaddr_un address {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::runtime_error("socket path too long: " + path);
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return address;
+  }
+
+  // the connection of the job being run, for report_crash
+  volatile std::sig_atomic_t job_connection = -1;
+
+  // a job that crashes still answers its client, with the exit status
+  // the signal gives a process, before the signal takes the process
+  // down
+  void report_crash(int signal) {
+    if (job_connection >= 0) {
+      auto byte = static_cast<char>(128 + signal);
+      send(job_connection, &byte, 1, MSG_NOSIGNAL);
+    }
+    raise(signal);
+  }
+
+  // the client's standard input, output and error, sent along with
+  // one byte
+  bool receive_files(int connection, int (&fds)[3]) {
+    char byte;
+    iovec iov {&byte, 1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))];
+    msghdr message {};
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(connection, &message, MSG_CMSG_CLOEXEC) != 1) return false;
+    auto header = CMSG_FIRSTHDR(&message);
+    if (!header || header->cmsg_level != SOL_SOCKET
+	|| header->cmsg_type != SCM_RIGHTS
+	|| header->cmsg_len != CMSG_LEN(sizeof(fds))) {
+      return false;
+    }
+    std::memcpy(fds, CMSG_DATA(header), sizeof(fds));
+    return true;
+  }
+}
+
+Server::Server(const std::string& path)
+  : path{path}
+{
+  auto address = socket_address(path);
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) system_error("can't create a socket");
+  // a socket left behind by a server that is gone is taken over, one
+  // that a server still answers on isn't
+  if (connect(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+    close(listener);
+    throw std::runtime_error("a server is already listening on " + path);
+  }
+  close(listener);
+  listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0) system_error("can't create a socket");
+  unlink(path.c_str());
+  if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0
+      || listen(listener, SOMAXCONN) < 0) {
+    auto error = errno;
+    close(listener);
+    errno = error;
+    system_error("can't listen on " + path);
+  }
+  for (int i = 0; i < 3; ++i) {
+    saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+  }
+  // a client that goes away makes the job's writes fail rather than
+  // the server exit
+  std::signal(SIGPIPE, SIG_IGN);
+  // the handler runs on a stack of its own, as the usual crash is a
+  // job running out of stack
+  static char crash_stack[64 * 1024];
+  stack_t stack {};
+  stack.ss_sp = crash_stack;
+  stack.ss_size = sizeof(crash_stack);
+  sigaltstack(&stack, nullptr);
+  struct sigaction action {};
+  action.sa_handler = report_crash;
+  action.sa_flags = SA_ONSTACK | SA_RESETHAND | SA_NODEFER;
+  for (auto signal : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+    sigaction(signal, &action, nullptr);
+  }
+}
+
+Server::~Server() {
+  if (connection >= 0) close(connection);
+  close(listener);
+  unlink(path.c_str());
+  for (auto fd : saved) {
+    if (fd >= 0) close(fd);
+  }
+}
+
+void Server::accept() {
+  for (;;) {
+    connection = ::accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      system_error("can't accept a client");
+    }
+    int fds[3];
+    if (receive_files(connection, fds)) {
+      std::fflush(stdout);
+      std::fflush(stderr);
+      for (int i = 0; i < 3; ++i) {
+	dup2(fds[i], i);
+	close(fds[i]);
+      }
+      // anything read ahead is the last job's
+      std::clearerr(stdin);
+      __fpurge(stdin);
+      std::cin.clear();
+      memory.reset_standard_input();
+      printer.check_terminal();
+      job_connection = connection;
+      return;
+    }
+    close(connection);
+  }
+}
+
+void Server::finish(int status) {
+  std::fflush(stdout);
+  std::fflush(stderr);
+  for (int i = 0; i < 3; ++i) {
+    dup2(saved[i], i);
+  }
+  printer.check_terminal();
+  auto byte = static_cast<char>(status);
+  job_connection = -1;
+  send(connection, &byte, 1, MSG_NOSIGNAL);
+  close(connection);
+  connection = -1;
+}
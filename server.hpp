@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+
+// The socket side of -server: a kale that stays up with its JIT set up
+// and runs the programs kale-client sends it, one after the other. The
+// client passes its standard input, output and error over the socket,
+// so a job reads its program and input and writes its output and
+// errors directly, as kale would, and gets the job's exit status back.
+//
+// The protocol is one byte from the client carrying the three file
+// descriptors (SCM_RIGHTS), answered by one byte of exit status. A job
+// that crashes answers with 128 plus the signal's number, like a shell
+// reports a process killed by it, on its way down.
+class Server {
+public:
+  explicit Server(const std::string& path);
+  ~Server();
+  // waits for the next client and makes its files the process's
+  // standard input, output and error
+  void accept();
+  // sends the job's exit status to its client and puts the server's
+  // own files back
+  void finish(int status);
+
+private:
+  std::string path;
+  int listener;
+  int connection {-1};
+  // the server's own standard input, output and error
+  int saved[3];
+};
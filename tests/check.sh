@@ -0,0 +1,27 @@
+#!/bin/sh
+# Runs the tests that have RUN lines, the way LLVM's lit does: %s in a
+# RUN line stands for the test and %t for a scratch file of its own.
+# A test's RUN and CHECK lines go after its program, where kale takes
+# them for the program's input. KALE and FILECHECK override where the
+# binaries are.
+KALE=${KALE:-./kale}
+FILECHECK=${FILECHECK:-FileCheck}
+scratch=$(mktemp -d)
+trap 'rm -rf "$scratch"' EXIT
+status=0
+for test in $(grep -l '^; RUN:' tests/*.kale); do
+  name=$(basename "$test" .kale)
+  {
+    echo "kale() { \"$KALE\" \"\$@\"; }"
+    echo "FileCheck() { \"$FILECHECK\" \"\$@\"; }"
+    sed -n "s|^; RUN: *||; T; s|%s|$test|g; s|%t|$scratch/$name|g; p" "$test"
+  } > "$scratch/run"
+  if sh -e "$scratch/run" > "$scratch/log" 2>&1; then
+    echo "PASS: $test"
+  else
+    echo "FAIL: $test"
+    cat "$scratch/log"
+    status=1
+  fi
+done
+exit $status